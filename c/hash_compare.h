@@ -0,0 +1,49 @@
+#ifndef CLERKB_HASH_COMPARE_H_
+#define CLERKB_HASH_COMPARE_H_
+
+// Hash compares shared by PoA lock and state lock. Scripts are built with
+// -fno-builtin-memcmp, making each memcmp call a byte-wise loop, while the
+// compares here take one 64-bit word per 8 bytes. Words are read via memcpy,
+// which stays a builtin, so the compares are valid for any buffer alignment
+// and type; callers keep hash buffers 8-byte aligned where possible, which
+// lets the compiler use plain 64-bit loads.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline uint64_t hash_word(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, 8);
+  return word;
+}
+
+// Tests if 32-byte hashes a and b are equal.
+static inline int hash_equal(const uint8_t *a, const uint8_t *b) {
+  return ((hash_word(a) ^ hash_word(b)) |
+          (hash_word(&a[8]) ^ hash_word(&b[8])) |
+          (hash_word(&a[16]) ^ hash_word(&b[16])) |
+          (hash_word(&a[24]) ^ hash_word(&b[24]))) == 0;
+}
+
+// Tests if the first size bytes of a and b are equal, size is at most 32. Used
+// for identities, which can be prefixes of hashes.
+static inline int hash_prefix_equal(const uint8_t *a, const uint8_t *b,
+                                    size_t size) {
+  if (size == 32) {
+    return hash_equal(a, b);
+  }
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    if (hash_word(&a[i]) != hash_word(&b[i])) {
+      return 0;
+    }
+  }
+  for (; i < size; i++) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#endif /* CLERKB_HASH_COMPARE_H_ */
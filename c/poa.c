@@ -27,15 +27,26 @@
 // As always, we will need those headers to interact with CKB.
 #include "blake2b.h"
 #include "blockchain.h"
+#include "ckb_dlfcn.h"
 #include "ckb_syscalls.h"
+#include "hash_compare.h"
 
-#define SCRIPT_BUFFER_SIZE 128
-#define POA_BUFFER_SIZE 16384
+#define SCRIPT_BUFFER_SIZE 1024
+#define POA_MAX_DATA_CELLS 16
+#define IDENTITY_CHUNK_COUNT 16
+// The dual build only walks inputs once per call, and keeps its static memory
+// small since callers reserve it when loading the library.
+#ifdef POA_DUAL_LIBRARY
+#define INPUT_ARENA_CAPACITY 64
+#else
+#define INPUT_ARENA_CAPACITY 512
+#endif /* POA_DUAL_LIBRARY */
 #define SIGNATURE_WITNESS_BUFFER_SIZE 32768
 #define ONE_BATCH_SIZE 32768
 #define CODE_SIZE (256 * 1024)
 #define PREFILLED_DATA_SIZE (1024 * 1024)
 #define IDENTITY_SIZE 32
+#define SIGNATURE_SIZE 65
 
 #define ERROR_TRANSACTION -1
 #define ERROR_ENCODING -2
@@ -47,88 +58,701 @@
 #define DEBUG(s)
 #endif /* ENABLE_DEBUG_MODE */
 
+// The combined build also acts as the state lock for PoA setup and PoA data
+// cells, so one binary and one cell dep serve all cells of a PoA instance.
+#ifdef POA_WITH_STATE_LOCK
+#include "state_lock.h"
+#endif /* POA_WITH_STATE_LOCK */
+
 typedef struct {
-  const uint8_t *_source_data;
   size_t _source_length;
 
   int round_interval_uses_seconds;
+  int identities_sorted;
+  int signature_identities;
+  int merkle_identities;
+  int early_handoff;
+  // Number of lanes, 1 when lanes are not used
+  uint8_t lane_count;
+  // Length of the overlap window at the end of a round, 0 when not used
+  uint32_t overlap_window;
+  // Whether subtime comes from a header dep instead of since
+  int header_time;
+  // Largest amount of seconds the header dep timestamp can lead since
+  uint32_t max_header_age;
   uint8_t identity_size;
-  uint8_t aggregator_number;
-  uint8_t aggregator_change_threshold;
+  uint16_t aggregator_number;
+  uint16_t aggregator_change_threshold;
   uint32_t round_intervals;
   uint32_t subblocks_per_round;
-  const uint8_t *identities;
+  // Offset of extension fields following identities
+  size_t extension_offset;
+  // Extension fields after Merkle identities, see parse_poa_setup_tail
+  size_t tail_offset;
+  size_t tail_length;
+  uint8_t merkle_root[32];
 } PoASetup;
 
-int parse_poa_setup(const uint8_t *source_data, size_t source_length,
-                    PoASetup *output) {
-  if (source_length < 12) {
+// PoA setup cell layout:
+// * byte 0: flags, see POA_SETUP_FLAG_* below
+// * byte 1: identity size
+// * byte 2: aggregator number
+// * byte 3: aggregator change threshold
+// * byte 4-7: round intervals, little endian uint32_t
+// * byte 8-11: subblocks per round, little endian uint32_t
+// * byte 12-: identities, each taking identity size bytes
+// * extension fields enabled by flags, in the order of flags below
+#define POA_SETUP_FLAG_ROUND_INTERVAL_USES_SECONDS 0x1
+// When set, identities are stored in strictly ascending byte order, so
+// consensus mode can locate a lock hash via binary search. Note the order
+// also determines the order aggregators take turns issuing subblocks.
+#define POA_SETUP_FLAG_IDENTITIES_SORTED 0x2
+// When set, identities are secp256k1 public key hashes instead of lock script
+// hashes, an aggregator is authorized by a signature in the PoA witness. The
+// extension field is the 32 byte data hash of the signature library used to
+// verify signatures.
+#define POA_SETUP_FLAG_SIGNATURE_IDENTITIES 0x4
+// When set, identities are not stored in the setup cell, only a Merkle root
+// of them is kept, see verify_merkle_proof for the tree layout. Aggregator
+// number and aggregator change threshold in the header must be 0, the
+// extension field contains the actual values as little endian uint16_t,
+// followed by the 32 byte Merkle root. This allows up to 65535 aggregators,
+// with setup cell size independent of the number of aggregators.
+#define POA_SETUP_FLAG_MERKLE_IDENTITIES 0x8
+// When set, a round is closed as soon as its aggregator issues the last
+// subblock allowed by subblocks_per_round, and the next aggregator can start
+// its round right away instead of waiting for round_intervals to pass.
+#define POA_SETUP_FLAG_EARLY_HANDOFF 0x10
+// When set, aggregators are split into lanes, each advancing its own PoA data
+// cell in parallel. Aggregator i belongs to lane i % lane_count, and only
+// takes turns with other aggregators of the same lane, a lane is identified
+// by the aggregator index in its PoA data cell. The extension field is the
+// lane count as uint8_t, which must be between 1 and aggregator number.
+#define POA_SETUP_FLAG_LANES 0x20
+// When set, the last overlap_window of a round overlaps with the next round:
+// the next aggregator can open its round once the window starts, while the
+// outgoing aggregator can only commit one more subblock within the window,
+// which closes its round. The extension field is the window length as
+// uint32_t, which must be less than round_intervals.
+#define POA_SETUP_FLAG_OVERLAP_WINDOW 0x40
+// When set, the subtime of new subblocks is the timestamp in seconds of a
+// header dep, instead of since, which is gated by the lagging median time.
+// since must still be no later than the header timestamp, and can trail it by
+// at most max_header_age seconds. The extension field is max_header_age as
+// uint32_t. Only valid when round intervals use seconds.
+#define POA_SETUP_FLAG_HEADER_TIME 0x80
+#define POA_SETUP_HEADER_SIZE 12
+#define POA_SETUP_SIGNATURE_EXTENSION_SIZE 32
+#define POA_SETUP_MERKLE_EXTENSION_SIZE 36
+#define POA_SETUP_LANES_EXTENSION_SIZE 1
+#define POA_SETUP_OVERLAP_WINDOW_EXTENSION_SIZE 4
+#define POA_SETUP_HEADER_TIME_EXTENSION_SIZE 4
+// Largest size of extension fields after Merkle identities.
+#define POA_SETUP_TAIL_SIZE                                                  \
+  (POA_SETUP_LANES_EXTENSION_SIZE + POA_SETUP_OVERLAP_WINDOW_EXTENSION_SIZE + \
+   POA_SETUP_HEADER_TIME_EXTENSION_SIZE)
+// Largest prefix of setup cell needed to parse everything except identities.
+#define POA_SETUP_PREFIX_SIZE                                         \
+  (POA_SETUP_HEADER_SIZE + POA_SETUP_SIGNATURE_EXTENSION_SIZE + \
+   POA_SETUP_MERKLE_EXTENSION_SIZE)
+
+// Specialized builds fix identity size and aggregator number at compile time
+// via POA_FIXED_IDENTITY_SIZE and POA_FIXED_AGGREGATOR_NUMBER, PoA setups of
+// other shapes are rejected. The accessors below then fold into constants, so
+// loops over identities are unrolled into fixed size compares.
+#ifdef POA_FIXED_IDENTITY_SIZE
+#define SETUP_IDENTITY_SIZE(setup) ((size_t)POA_FIXED_IDENTITY_SIZE)
+#else
+#define SETUP_IDENTITY_SIZE(setup) ((size_t)(setup)->identity_size)
+#endif /* POA_FIXED_IDENTITY_SIZE */
+#ifdef POA_FIXED_AGGREGATOR_NUMBER
+#define SETUP_AGGREGATOR_NUMBER(setup) ((size_t)POA_FIXED_AGGREGATOR_NUMBER)
+#else
+#define SETUP_AGGREGATOR_NUMBER(setup) ((size_t)(setup)->aggregator_number)
+#endif /* POA_FIXED_AGGREGATOR_NUMBER */
+// Merkle identities exist so large committees need not store every identity,
+// a build with a fixed aggregator number rejects them, and leaves out the
+// Merkle paths altogether.
+#ifdef POA_FIXED_AGGREGATOR_NUMBER
+#define SETUP_MERKLE_IDENTITIES(setup) 0
+#else
+#define SETUP_MERKLE_IDENTITIES(setup) ((setup)->merkle_identities)
+#endif /* POA_FIXED_AGGREGATOR_NUMBER */
+
+// Depth of the Merkle tree built from aggregator_number identities.
+size_t merkle_depth(const PoASetup *poa_setup) {
+  size_t depth = 0;
+  while (((size_t)1 << depth) < SETUP_AGGREGATOR_NUMBER(poa_setup)) {
+    depth++;
+  }
+  return depth;
+}
+
+size_t merkle_proof_size(const PoASetup *poa_setup) {
+  return 2 + SETUP_IDENTITY_SIZE(poa_setup) + 32 * merkle_depth(poa_setup);
+}
+
+// Size of the PoA witness, as stored in the lock field of WitnessArgs, needed
+// to update a setup with Merkle identities: the 4 byte length of lock bytes,
+// consensus mode hints, then one Merkle proof and, with signature identities,
+// one signature per approving aggregator. Each witness entry has a 3 byte
+// header.
+size_t merkle_consensus_witness_size(const PoASetup *poa_setup) {
+  size_t threshold = poa_setup->aggregator_change_threshold;
+  size_t size = 4 + (3 + 8) + (3 + threshold * merkle_proof_size(poa_setup));
+  if (poa_setup->signature_identities) {
+    size += 3 + threshold * SIGNATURE_SIZE;
+  }
+  return size;
+}
+
+// Parses the fixed size header part of PoA setup, source_length is the length
+// of the full setup, which is validated against the header. source_data must
+// hold at least the first POA_SETUP_PREFIX_SIZE bytes of the setup, or the
+// whole setup when it is shorter. The identities are not touched here, so the
+// caller can choose to load only the ones it needs.
+int parse_poa_setup_header(const uint8_t *source_data, size_t source_length,
+                           PoASetup *output) {
+  if (source_length < POA_SETUP_HEADER_SIZE) {
     DEBUG("PoA data have invalid length!");
     return ERROR_ENCODING;
   }
-  output->_source_data = source_data;
   output->_source_length = source_length;
 
-  output->round_interval_uses_seconds = (source_data[0] & 1) == 1;
+  output->round_interval_uses_seconds =
+      (source_data[0] & POA_SETUP_FLAG_ROUND_INTERVAL_USES_SECONDS) != 0;
+  output->identities_sorted =
+      (source_data[0] & POA_SETUP_FLAG_IDENTITIES_SORTED) != 0;
+  output->signature_identities =
+      (source_data[0] & POA_SETUP_FLAG_SIGNATURE_IDENTITIES) != 0;
+  output->merkle_identities =
+      (source_data[0] & POA_SETUP_FLAG_MERKLE_IDENTITIES) != 0;
+  output->early_handoff = (source_data[0] & POA_SETUP_FLAG_EARLY_HANDOFF) != 0;
+  output->lane_count = 1;
+  output->overlap_window = 0;
+  output->header_time = (source_data[0] & POA_SETUP_FLAG_HEADER_TIME) != 0;
+  output->max_header_age = 0;
   output->identity_size = source_data[1];
   output->aggregator_number = source_data[2];
   output->aggregator_change_threshold = source_data[3];
   output->round_intervals = *((uint32_t *)(&source_data[4]));
   output->subblocks_per_round = *((uint32_t *)(&source_data[8]));
-  output->identities = &source_data[12];
 
+#ifdef POA_FIXED_IDENTITY_SIZE
+  if (output->identity_size != POA_FIXED_IDENTITY_SIZE) {
+    DEBUG("Identity size does not match specialized build!");
+    return ERROR_ENCODING;
+  }
+#else
   if (output->identity_size > IDENTITY_SIZE) {
     DEBUG("Invalid identity size!");
     return ERROR_ENCODING;
   }
+#endif /* POA_FIXED_IDENTITY_SIZE */
+#ifdef POA_FIXED_AGGREGATOR_NUMBER
+  if (output->merkle_identities ||
+      output->aggregator_number != POA_FIXED_AGGREGATOR_NUMBER) {
+    DEBUG("Aggregator number does not match specialized build!");
+    return ERROR_ENCODING;
+  }
+#else
+  if (output->merkle_identities &&
+      (output->aggregator_number != 0 ||
+       output->aggregator_change_threshold != 0 || output->identities_sorted)) {
+    DEBUG("Invalid Merkle identities!");
+    return ERROR_ENCODING;
+  }
+#endif /* POA_FIXED_AGGREGATOR_NUMBER */
+  output->extension_offset =
+      POA_SETUP_HEADER_SIZE +
+      SETUP_IDENTITY_SIZE(output) * SETUP_AGGREGATOR_NUMBER(output);
+  size_t extension_length = 0;
+  if (output->signature_identities) {
+    extension_length += POA_SETUP_SIGNATURE_EXTENSION_SIZE;
+  }
+#ifndef POA_FIXED_AGGREGATOR_NUMBER
+  size_t merkle_offset = output->extension_offset + extension_length;
+  if (output->merkle_identities) {
+    extension_length += POA_SETUP_MERKLE_EXTENSION_SIZE;
+  }
+#endif /* POA_FIXED_AGGREGATOR_NUMBER */
+  output->tail_offset = output->extension_offset + extension_length;
+  output->tail_length = 0;
+  if ((source_data[0] & POA_SETUP_FLAG_LANES) != 0) {
+    output->tail_length += POA_SETUP_LANES_EXTENSION_SIZE;
+  }
+  if ((source_data[0] & POA_SETUP_FLAG_OVERLAP_WINDOW) != 0) {
+    output->tail_length += POA_SETUP_OVERLAP_WINDOW_EXTENSION_SIZE;
+  }
+  if ((source_data[0] & POA_SETUP_FLAG_HEADER_TIME) != 0) {
+    output->tail_length += POA_SETUP_HEADER_TIME_EXTENSION_SIZE;
+  }
+  extension_length += output->tail_length;
+  if (source_length != output->extension_offset + extension_length) {
+    DEBUG("PoA data have invalid length!");
+    return ERROR_ENCODING;
+  }
+#ifndef POA_FIXED_AGGREGATOR_NUMBER
+  if (output->merkle_identities) {
+    // Without stored identities, the whole setup fits in the prefix.
+    output->aggregator_number = (uint16_t)source_data[merkle_offset] |
+                                ((uint16_t)source_data[merkle_offset + 1] << 8);
+    output->aggregator_change_threshold =
+        (uint16_t)source_data[merkle_offset + 2] |
+        ((uint16_t)source_data[merkle_offset + 3] << 8);
+    memcpy(output->merkle_root, &source_data[merkle_offset + 4], 32);
+    if (output->aggregator_number == 0) {
+      DEBUG("Invalid Merkle identities!");
+      return ERROR_ENCODING;
+    }
+  }
+#endif /* POA_FIXED_AGGREGATOR_NUMBER */
   if (output->aggregator_change_threshold > output->aggregator_number) {
     DEBUG("Invalid aggregator change threshold!");
     return ERROR_ENCODING;
   }
-  if (source_length !=
-      12 + (size_t)output->identity_size * (size_t)output->aggregator_number) {
+  // A setup update must be approved within a single PoA witness, a threshold
+  // whose proofs do not fit there would lock the setup cell forever.
+  if (SETUP_MERKLE_IDENTITIES(output) &&
+      merkle_consensus_witness_size(output) > SIGNATURE_WITNESS_BUFFER_SIZE) {
+    DEBUG("Aggregator change threshold does not fit in PoA witness!");
+    return ERROR_ENCODING;
+  }
+  return CKB_SUCCESS;
+}
+
+// Parses extension fields after Merkle identities, tail points to the
+// tail_length bytes at tail_offset of the PoA setup. Unlike the fields parsed
+// by parse_poa_setup_header, those follow identities, so they might not be
+// part of the prefix loaded from the setup cell.
+int parse_poa_setup_tail(const uint8_t *source_data, const uint8_t *tail,
+                         PoASetup *output) {
+  if ((source_data[0] & POA_SETUP_FLAG_LANES) != 0) {
+    output->lane_count = tail[0];
+    if (output->lane_count == 0 ||
+        output->lane_count > output->aggregator_number) {
+      DEBUG("Invalid lane count!");
+      return ERROR_ENCODING;
+    }
+    tail += POA_SETUP_LANES_EXTENSION_SIZE;
+  }
+  if ((source_data[0] & POA_SETUP_FLAG_OVERLAP_WINDOW) != 0) {
+    output->overlap_window =
+        (uint32_t)tail[0] | ((uint32_t)tail[1] << 8) |
+        ((uint32_t)tail[2] << 16) | ((uint32_t)tail[3] << 24);
+    if (output->overlap_window >= output->round_intervals) {
+      DEBUG("Invalid overlap window!");
+      return ERROR_ENCODING;
+    }
+    tail += POA_SETUP_OVERLAP_WINDOW_EXTENSION_SIZE;
+  }
+  if (output->header_time) {
+    output->max_header_age =
+        (uint32_t)tail[0] | ((uint32_t)tail[1] << 8) |
+        ((uint32_t)tail[2] << 16) | ((uint32_t)tail[3] << 24);
+    if (!output->round_interval_uses_seconds) {
+      DEBUG("Header time requires round intervals in seconds!");
+      return ERROR_ENCODING;
+    }
+  }
+  return CKB_SUCCESS;
+}
+
+// Loads PoA setup at index of source, only the prefix and extension fields of
+// the cell data are loaded, identities are left to be loaded on demand. The
+// reported length of the whole cell data is still validated.
+int load_poa_setup(size_t index, size_t source, PoASetup *output) {
+  uint8_t prefix[POA_SETUP_PREFIX_SIZE];
+  uint64_t len = POA_SETUP_PREFIX_SIZE;
+  int ret = ckb_load_cell_data(prefix, &len, 0, index, source);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  ret = parse_poa_setup_header(prefix, len, output);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (output->tail_length == 0) {
+    return CKB_SUCCESS;
+  }
+  // The whole setup is in prefix when it is short enough
+  if (len <= POA_SETUP_PREFIX_SIZE) {
+    return parse_poa_setup_tail(prefix, &prefix[output->tail_offset], output);
+  }
+  uint8_t tail[POA_SETUP_TAIL_SIZE];
+  len = output->tail_length;
+  ret = ckb_load_cell_data(tail, &len, output->tail_offset, index, source);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len != output->tail_length) {
     DEBUG("PoA data have invalid length!");
     return ERROR_ENCODING;
   }
+  return parse_poa_setup_tail(prefix, tail, output);
+}
+
+// Loads count identities starting from first out of the PoA setup cell at
+// index of source, without touching the rest of the cell data.
+int load_setup_identities(const PoASetup *poa_setup, size_t index,
+                          size_t source, size_t first, size_t count,
+                          uint8_t *identities) {
+  uint64_t len = count * SETUP_IDENTITY_SIZE(poa_setup);
+  int ret = ckb_load_cell_data(
+      identities, &len,
+      POA_SETUP_HEADER_SIZE + first * SETUP_IDENTITY_SIZE(poa_setup), index,
+      source);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len < count * SETUP_IDENTITY_SIZE(poa_setup)) {
+    DEBUG("Invalid identities!");
+    return ERROR_ENCODING;
+  }
+  return CKB_SUCCESS;
+}
+
+// Checks identities in PoA setup cell are strictly sorted, streaming them in
+// chunks of IDENTITY_CHUNK_COUNT.
+int check_setup_identities_sorted(const PoASetup *poa_setup, size_t index,
+                                  size_t source) {
+  uint8_t identities[IDENTITY_CHUNK_COUNT * IDENTITY_SIZE];
+  uint8_t last_identity[IDENTITY_SIZE];
+  size_t identity_size = SETUP_IDENTITY_SIZE(poa_setup);
+  for (size_t first = 0; first < SETUP_AGGREGATOR_NUMBER(poa_setup);
+       first += IDENTITY_CHUNK_COUNT) {
+    size_t count = SETUP_AGGREGATOR_NUMBER(poa_setup) - first;
+    if (count > IDENTITY_CHUNK_COUNT) {
+      count = IDENTITY_CHUNK_COUNT;
+    }
+    int ret = load_setup_identities(poa_setup, index, source, first, count,
+                                    identities);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *identity = &identities[i * identity_size];
+      if ((first > 0 || i > 0) &&
+          memcmp(last_identity, identity, identity_size) >= 0) {
+        DEBUG("Identities are not sorted!");
+        return ERROR_ENCODING;
+      }
+      memcpy(last_identity, identity, identity_size);
+    }
+  }
+  return CKB_SUCCESS;
+}
+
+// Locates hash in sorted identities with a binary search over the whole
+// setup, loading only the probed identities. Sorted identities are unique, so
+// there is at most one candidate. found_identity is set to aggregator_number
+// when there is none.
+int find_sorted_identity(const uint8_t *hash, const PoASetup *poa_setup,
+                         size_t index, size_t source, size_t *found_identity) {
+  size_t low = 0;
+  size_t high = SETUP_AGGREGATOR_NUMBER(poa_setup);
+  *found_identity = SETUP_AGGREGATOR_NUMBER(poa_setup);
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    uint8_t identity[IDENTITY_SIZE];
+    int ret =
+        load_setup_identities(poa_setup, index, source, middle, 1, identity);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    int cmp = memcmp(hash, identity, SETUP_IDENTITY_SIZE(poa_setup));
+    if (cmp == 0) {
+      *found_identity = middle;
+      return CKB_SUCCESS;
+    }
+    if (cmp < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return CKB_SUCCESS;
+}
+
+// Returns the index of the first identity in a chunk of loaded identities
+// starting from first that matches hash and is not yet used in mask, or
+// first + count when there is none.
+size_t match_identity(const uint8_t *hash, const uint8_t *identities,
+                      size_t identity_size, size_t first, size_t count,
+                      const uint64_t *mask) {
+  size_t found_identity;
+  for (found_identity = 0; found_identity < count; found_identity++) {
+    size_t current = first + found_identity;
+    int used = ((mask[current / 64] >> (current % 64)) & 1) != 0;
+    if ((!used) &&
+        hash_prefix_equal(hash, &identities[found_identity * identity_size],
+                          identity_size)) {
+      break;
+    }
+  }
+  return first + found_identity;
+}
+
+// Returns the index of the first identity in unsorted identities matching
+// hash that is not yet used in mask, or aggregator_number when there is none.
+// Identities are streamed in chunks of IDENTITY_CHUNK_COUNT.
+int find_unsorted_identity(const uint8_t *hash, const PoASetup *poa_setup,
+                           size_t index, size_t source, const uint64_t *mask,
+                           size_t *found_identity) {
+  uint8_t identities[IDENTITY_CHUNK_COUNT * IDENTITY_SIZE];
+  for (size_t first = 0; first < SETUP_AGGREGATOR_NUMBER(poa_setup);
+       first += IDENTITY_CHUNK_COUNT) {
+    size_t count = SETUP_AGGREGATOR_NUMBER(poa_setup) - first;
+    if (count > IDENTITY_CHUNK_COUNT) {
+      count = IDENTITY_CHUNK_COUNT;
+    }
+    int ret = load_setup_identities(poa_setup, index, source, first, count,
+                                    identities);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    *found_identity = match_identity(
+        hash, identities, SETUP_IDENTITY_SIZE(poa_setup), first, count, mask);
+    if (*found_identity < first + count) {
+      return CKB_SUCCESS;
+    }
+  }
+  *found_identity = SETUP_AGGREGATOR_NUMBER(poa_setup);
+  return CKB_SUCCESS;
+}
+
+// Lock hashes and type hashes of the first INPUT_ARENA_CAPACITY inputs are
+// cached here the first time they are loaded, so every later walk over
+// inputs, no matter which validation stage it belongs to, reads them without
+// issuing syscalls: locating PoA cells in inputs only loads type hashes once
+// however many PoA cells are looked for, and signing checks share the lock
+// hashes. Each field is cached on its own, so a walk only pays for the field
+// it needs. Inputs beyond the capacity are loaded again on each access.
+typedef struct {
+  // Number of inputs whose lock hashes are cached
+  size_t loaded;
+  // Number of inputs whose type hashes are cached
+  size_t types_loaded;
+  // Number of inputs in current transaction, SIZE_MAX when not known yet
+  size_t input_count;
+  uint8_t lock_hashes[INPUT_ARENA_CAPACITY][32];
+  uint8_t type_hashes[INPUT_ARENA_CAPACITY][32];
+  // One bit per cached type hash, cleared when the input has no type script
+  uint64_t type_present[INPUT_ARENA_CAPACITY / 64];
+} InputArena;
+
+void init_input_arena(InputArena *arena) {
+  arena->loaded = 0;
+  arena->types_loaded = 0;
+  arena->input_count = SIZE_MAX;
+}
+
+// Loads lock hash of the input at index, CKB_INDEX_OUT_OF_BOUND is returned
+// when index is past the last input.
+int load_input_lock_hash(InputArena *arena, size_t index, uint8_t *hash) {
+  if (index < arena->loaded) {
+    memcpy(hash, arena->lock_hashes[index], 32);
+    return CKB_SUCCESS;
+  }
+  if (index >= arena->input_count) {
+    return CKB_INDEX_OUT_OF_BOUND;
+  }
+  uint64_t len = 32;
+  int ret = ckb_load_cell_by_field(hash, &len, 0, index, CKB_SOURCE_INPUT,
+                                   CKB_CELL_FIELD_LOCK_HASH);
+  if (ret == CKB_INDEX_OUT_OF_BOUND) {
+    arena->input_count = index;
+    return ret;
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len != 32) {
+    DEBUG("Invalid lock hash!");
+    return ERROR_ENCODING;
+  }
+  if (index == arena->loaded && index < INPUT_ARENA_CAPACITY) {
+    memcpy(arena->lock_hashes[index], hash, 32);
+    arena->loaded++;
+  }
   return CKB_SUCCESS;
 }
 
-int validate_consensus_signing(const uint8_t *identity_buffer,
-                               size_t identity_size, uint8_t identity_count,
-                               uint8_t aggregator_change_threshold) {
+// Loads type hash of the input at index, CKB_ITEM_MISSING is returned when the
+// input has no type script, CKB_INDEX_OUT_OF_BOUND when index is past the last
+// input.
+int load_input_type_hash(InputArena *arena, size_t index, uint8_t *hash) {
+  if (index < arena->types_loaded) {
+    if (((arena->type_present[index / 64] >> (index % 64)) & 1) == 0) {
+      return CKB_ITEM_MISSING;
+    }
+    memcpy(hash, arena->type_hashes[index], 32);
+    return CKB_SUCCESS;
+  }
+  if (index >= arena->input_count) {
+    return CKB_INDEX_OUT_OF_BOUND;
+  }
+  uint64_t len = 32;
+  int ret = ckb_load_cell_by_field(hash, &len, 0, index, CKB_SOURCE_INPUT,
+                                   CKB_CELL_FIELD_TYPE_HASH);
+  if (ret == CKB_INDEX_OUT_OF_BOUND) {
+    arena->input_count = index;
+    return ret;
+  }
+  if (ret != CKB_SUCCESS && ret != CKB_ITEM_MISSING) {
+    return ret;
+  }
+  if (ret == CKB_SUCCESS && len != 32) {
+    DEBUG("Invalid type hash!");
+    return ERROR_ENCODING;
+  }
+  if (index == arena->types_loaded && index < INPUT_ARENA_CAPACITY) {
+    uint64_t bit = ((uint64_t)1) << (index % 64);
+    if (ret == CKB_SUCCESS) {
+      memcpy(arena->type_hashes[index], hash, 32);
+      arena->type_present[index / 64] |= bit;
+    } else {
+      arena->type_present[index / 64] &= ~bit;
+    }
+    arena->types_loaded++;
+  }
+  return ret;
+}
+
+// Loads type hash of the cell at index of source, inputs are read through the
+// arena. Return values follow load_input_type_hash.
+int load_cell_type_hash(InputArena *arena, size_t index, size_t source,
+                        uint8_t *hash) {
+  if (source == CKB_SOURCE_INPUT) {
+    return load_input_type_hash(arena, index, hash);
+  }
+  uint64_t len = 32;
+  int ret = ckb_load_cell_by_field(hash, &len, 0, index, source,
+                                   CKB_CELL_FIELD_TYPE_HASH);
+  if (ret == CKB_SUCCESS && len != 32) {
+    DEBUG("Invalid type hash!");
+    return ERROR_ENCODING;
+  }
+  return ret;
+}
+
+// Validates that enough aggregators listed in the PoA setup cell at index of
+// source agree on current transaction. Identities are loaded from the cell on
+// demand instead of keeping the whole setup in memory, and input lock hashes
+// are loaded lazily, so matching stops as soon as the threshold is reached.
+//
+// With sorted identities, each input is located via a binary search over the
+// whole setup. Otherwise, each chunk of identities is matched against inputs
+// cached in the arena, so it only needs to be loaded once, inputs beyond arena
+// capacity stream the identities on their own.
+int validate_consensus_signing(InputArena *arena, const PoASetup *poa_setup,
+                               size_t index, size_t source) {
+  // One bit per identity, 256 bits cover all possible aggregators.
   uint64_t mask[4];
   mask[0] = mask[1] = mask[2] = mask[3] = 0;
-  uint8_t found = 0;
-  size_t current = 0;
-  while (current < SIZE_MAX) {
-    uint64_t len = 32;
-    uint8_t hash[32];
+  size_t found = 0;
 
-    int ret = ckb_load_cell_by_field(hash, &len, 0, current, CKB_SOURCE_INPUT,
-                                     CKB_CELL_FIELD_LOCK_HASH);
-    if (ret == CKB_INDEX_OUT_OF_BOUND) {
-      break;
+  if (poa_setup->identities_sorted) {
+    size_t current = 0;
+    while (current < SIZE_MAX) {
+      uint8_t hash[32];
+      int ret = load_input_lock_hash(arena, current, hash);
+      if (ret == CKB_INDEX_OUT_OF_BOUND) {
+        break;
+      }
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      size_t found_identity = SETUP_AGGREGATOR_NUMBER(poa_setup);
+      ret = find_sorted_identity(hash, poa_setup, index, source,
+                                 &found_identity);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      if (found_identity < SETUP_AGGREGATOR_NUMBER(poa_setup) &&
+          ((mask[found_identity / 64] >> (found_identity % 64)) & 1) == 0) {
+        // New match found
+        found++;
+        if (found == poa_setup->aggregator_change_threshold) {
+          return CKB_SUCCESS;
+        }
+        mask[found_identity / 64] |= ((uint64_t)1) << (found_identity % 64);
+      }
+      current++;
+    }
+    DEBUG("Not enough matching identities found!");
+    return ERROR_ENCODING;
+  }
+
+  // One bit per cached input that already provides an identity.
+  uint64_t input_mask[INPUT_ARENA_CAPACITY / 64];
+  memset(input_mask, 0, sizeof(input_mask));
+  // Number of inputs, known once the first chunk reaches the last input.
+  size_t cached_inputs = INPUT_ARENA_CAPACITY;
+
+  uint8_t identities[IDENTITY_CHUNK_COUNT * IDENTITY_SIZE];
+  for (size_t first = 0; first < SETUP_AGGREGATOR_NUMBER(poa_setup);
+       first += IDENTITY_CHUNK_COUNT) {
+    size_t count = SETUP_AGGREGATOR_NUMBER(poa_setup) - first;
+    if (count > IDENTITY_CHUNK_COUNT) {
+      count = IDENTITY_CHUNK_COUNT;
     }
+    int ret = load_setup_identities(poa_setup, index, source, first, count,
+                                    identities);
     if (ret != CKB_SUCCESS) {
       return ret;
     }
-    uint8_t found_identity = 0;
-    for (; found_identity < identity_count; found_identity++) {
-      int found =
-          ((mask[found_identity / 64] >> (found_identity % 64)) & 1) != 0;
-      if ((!found) &&
-          memcmp(hash, &identity_buffer[found_identity * identity_size],
-                 identity_size) == 0) {
+    for (size_t i = 0; i < cached_inputs; i++) {
+      if (((input_mask[i / 64] >> (i % 64)) & 1) != 0) {
+        continue;
+      }
+      uint8_t hash[32];
+      ret = load_input_lock_hash(arena, i, hash);
+      if (ret == CKB_INDEX_OUT_OF_BOUND) {
+        cached_inputs = i;
         break;
       }
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      size_t found_identity =
+          match_identity(hash, identities, SETUP_IDENTITY_SIZE(poa_setup),
+                         first, count, mask);
+      if (found_identity < first + count) {
+        // New match found
+        found++;
+        if (found == poa_setup->aggregator_change_threshold) {
+          return CKB_SUCCESS;
+        }
+        mask[found_identity / 64] |= ((uint64_t)1) << (found_identity % 64);
+        input_mask[i / 64] |= ((uint64_t)1) << (i % 64);
+      }
+    }
+  }
+
+  size_t current = cached_inputs;
+  while (cached_inputs == INPUT_ARENA_CAPACITY && current < SIZE_MAX) {
+    uint8_t hash[32];
+    int ret = load_input_lock_hash(arena, current, hash);
+    if (ret == CKB_INDEX_OUT_OF_BOUND) {
+      break;
+    }
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    size_t found_identity = SETUP_AGGREGATOR_NUMBER(poa_setup);
+    ret = find_unsorted_identity(hash, poa_setup, index, source, mask,
+                                 &found_identity);
+    if (ret != CKB_SUCCESS) {
+      return ret;
     }
-    if (found_identity < identity_count) {
+    if (found_identity < SETUP_AGGREGATOR_NUMBER(poa_setup)) {
       // New match found
       found++;
-      if (found == aggregator_change_threshold) {
+      if (found == poa_setup->aggregator_change_threshold) {
         return CKB_SUCCESS;
       }
-      mask[found_identity / 64] |= 1 << (found_identity % 64);
+      mask[found_identity / 64] |= ((uint64_t)1) << (found_identity % 64);
     }
     current++;
   }
@@ -136,22 +760,25 @@ int validate_consensus_signing(const uint8_t *identity_buffer,
   return ERROR_ENCODING;
 }
 
-int validate_single_signing(const uint8_t *identity, size_t identity_size) {
+// Validates that inputs contain more than skip cells owned by identity, so
+// callers can require a distinct owner cell for each repeated approval.
+int validate_distinct_signing(InputArena *arena, const uint8_t *identity,
+                              size_t identity_size, size_t skip) {
   size_t current = 0;
   while (current < SIZE_MAX) {
-    uint64_t len = 32;
-    uint8_t hash[32];
-
-    int ret = ckb_load_cell_by_field(hash, &len, 0, current, CKB_SOURCE_INPUT,
-                                     CKB_CELL_FIELD_LOCK_HASH);
+    uint8_t hash[32] __attribute__((aligned(8)));
+    int ret = load_input_lock_hash(arena, current, hash);
     if (ret == CKB_INDEX_OUT_OF_BOUND) {
       break;
     }
     if (ret != CKB_SUCCESS) {
       return ret;
     }
-    if (memcmp(hash, identity, identity_size) == 0) {
-      return CKB_SUCCESS;
+    if (hash_prefix_equal(hash, identity, identity_size)) {
+      if (skip == 0) {
+        return CKB_SUCCESS;
+      }
+      skip--;
     }
     current++;
   }
@@ -159,6 +786,11 @@ int validate_single_signing(const uint8_t *identity, size_t identity_size) {
   return ERROR_ENCODING;
 }
 
+int validate_single_signing(InputArena *arena, const uint8_t *identity,
+                            size_t identity_size) {
+  return validate_distinct_signing(arena, identity, identity_size, 0);
+}
+
 static const uint8_t type_id_script_prefix[53] = {
     0x55, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00,
     0x00, 0x31, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -166,22 +798,31 @@ static const uint8_t type_id_script_prefix[53] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x54, 0x59, 0x50,
     0x45, 0x5f, 0x49, 0x44, 0x01, 0x20, 0x00, 0x00, 0x00};
 
-int look_for_poa_cell(const uint8_t *type_id, size_t source, size_t *index) {
+// PoA cells are located via type script hashes, which are calculated only
+// once from type ID args here. This way only 32 bytes need to be loaded and
+// compared for each candidate cell, instead of the full type script.
+void calculate_type_id_script_hash(const uint8_t *type_id, uint8_t *hash) {
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, 32);
+  blake2b_update(&blake2b_ctx, type_id_script_prefix, 53);
+  blake2b_update(&blake2b_ctx, type_id, 32);
+  blake2b_final(&blake2b_ctx, hash, 32);
+}
+
+int look_for_poa_cell(InputArena *arena, const uint8_t *type_hash,
+                      size_t source, size_t *index) {
   size_t current = 0;
   size_t found_index = SIZE_MAX;
   int running = 1;
   while ((running == 1) && (current < SIZE_MAX)) {
-    uint64_t len = 85;
-    uint8_t script[85];
+    uint8_t hash[32] __attribute__((aligned(8)));
 
-    int ret = ckb_load_cell_by_field(script, &len, 0, current, source,
-                                     CKB_CELL_FIELD_TYPE);
+    int ret = load_cell_type_hash(arena, current, source, hash);
     switch (ret) {
       case CKB_ITEM_MISSING:
         break;
       case CKB_SUCCESS:
-        if (len == 85 && memcmp(type_id_script_prefix, script, 53) == 0 &&
-            memcmp(type_id, &script[53], 32) == 0) {
+        if (hash_equal(type_hash, hash)) {
           // Found a match;
           if (found_index != SIZE_MAX) {
             // More than one PoA cell exists
@@ -204,260 +845,1256 @@ int look_for_poa_cell(const uint8_t *type_id, size_t source, size_t *index) {
   return CKB_SUCCESS;
 }
 
-int main() {
-  // One CKB transaction can only have one cell using current lock.
-  uint64_t len = 0;
-  int ret = ckb_load_cell(NULL, &len, 0, 1, CKB_SOURCE_GROUP_INPUT);
-  if (ret != CKB_INDEX_OUT_OF_BOUND) {
-    DEBUG("Transaction has more than one input cell using current lock!");
-    return ERROR_TRANSACTION;
-  }
-  len = 0;
-  ret = ckb_load_cell(NULL, &len, 0, 1, CKB_SOURCE_GROUP_OUTPUT);
-  if (ret != CKB_INDEX_OUT_OF_BOUND) {
-    DEBUG("Transaction has more than one output cell using current lock!");
-    return ERROR_TRANSACTION;
-  }
+// Checks the cell at a hinted index is indeed the PoA cell. Type ID ensures
+// there can be at most one such cell in cell deps, inputs and outputs, so
+// unlike look_for_poa_cell, no scanning for duplicates is needed here.
+int check_poa_cell(InputArena *arena, const uint8_t *type_hash, size_t source,
+                   size_t index) {
+  uint8_t hash[32] __attribute__((aligned(8)));
 
-  // Load current script so as to extract PoA cell information
-  unsigned char script[SCRIPT_BUFFER_SIZE];
-  len = SCRIPT_BUFFER_SIZE;
-  ret = ckb_checked_load_script(script, &len, 0);
+  int ret = load_cell_type_hash(arena, index, source, hash);
+  if (ret == CKB_INDEX_OUT_OF_BOUND || ret == CKB_ITEM_MISSING) {
+    DEBUG("Invalid PoA cell hint!");
+    return ERROR_ENCODING;
+  }
   if (ret != CKB_SUCCESS) {
     return ret;
   }
-
-  mol_seg_t script_seg;
-  script_seg.ptr = (uint8_t *)script;
-  script_seg.size = len;
-  if (MolReader_Script_verify(&script_seg, false) != MOL_OK) {
-    DEBUG("molecule verification failure!");
+  if (!hash_equal(type_hash, hash)) {
+    DEBUG("Invalid PoA cell hint!");
     return ERROR_ENCODING;
   }
-  mol_seg_t args_seg = MolReader_Script_get_args(&script_seg);
-  mol_seg_t args_bytes_seg = MolReader_Bytes_raw_bytes(&args_seg);
+  return CKB_SUCCESS;
+}
 
-  if (args_bytes_seg.size != 64) {
-    DEBUG("Script args must be 64 bytes long!");
-    return ERROR_ENCODING;
+// Canonical layout built by PoAGenerator.fixTransactionSkeleton: the PoA cell
+// is input 0, PoA data cells follow in inputs and outputs starting from index
+// 1 in the order of script args, and the PoA setup cell is the last cell dep.
+// Without hints, these positions are tried first, falling back to scanning
+// when they don't match.
+#define POA_CANONICAL_DATA_CELL_INDEX 1
+
+// Tests if the cell at index of source is the PoA cell, without failing when
+// it is not.
+int probe_poa_cell(InputArena *arena, const uint8_t *type_hash,
+                   size_t source, size_t index, int *found) {
+  uint8_t hash[32] __attribute__((aligned(8)));
+
+  int ret = load_cell_type_hash(arena, index, source, hash);
+  if (ret == CKB_INDEX_OUT_OF_BOUND || ret == CKB_ITEM_MISSING) {
+    *found = 0;
+    return CKB_SUCCESS;
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
   }
+  *found = hash_equal(type_hash, hash);
+  return CKB_SUCCESS;
+}
 
-  size_t dep_poa_setup_cell_index = SIZE_MAX;
-  ret = look_for_poa_cell(args_bytes_seg.ptr, CKB_SOURCE_CELL_DEP,
-                          &dep_poa_setup_cell_index);
-  if (ret != CKB_INDEX_OUT_OF_BOUND && ret != CKB_SUCCESS) {
+// Locates the PoA cell, trying canonical_index before scanning source.
+int locate_poa_cell(InputArena *arena, const uint8_t *type_hash,
+                    size_t source, size_t canonical_index, size_t *index) {
+  int found = 0;
+  int ret =
+      probe_poa_cell(arena, type_hash, source, canonical_index, &found);
+  if (ret != CKB_SUCCESS) {
     return ret;
   }
-  if (ret == CKB_SUCCESS) {
-    // Normal new blocks
-    uint8_t dep_poa_setup_buffer[POA_BUFFER_SIZE];
-    uint64_t len = POA_BUFFER_SIZE;
-    ret = ckb_load_cell_data(dep_poa_setup_buffer, &len, 0,
-                             dep_poa_setup_cell_index, CKB_SOURCE_CELL_DEP);
-    if (ret != CKB_SUCCESS) {
-      return ret;
-    }
-    if (len > POA_BUFFER_SIZE) {
-      DEBUG("Dep PoA cell is too large!");
-      return ERROR_ENCODING;
-    }
-    PoASetup poa_setup;
-    ret = parse_poa_setup(dep_poa_setup_buffer, len, &poa_setup);
-    if (ret != CKB_SUCCESS) {
+  if (found) {
+    *index = canonical_index;
+    return CKB_SUCCESS;
+  }
+  return look_for_poa_cell(arena, type_hash, source, index);
+}
+
+// Locates the PoA setup cell in cell deps. Knowing the last cell dep would
+// require probing the number of cell deps first, costing more syscalls than
+// the few cell deps of the canonical layout. So cell deps are still scanned,
+// but like check_poa_cell, the scan stops at the first match instead of
+// looking for duplicates. CKB_INDEX_OUT_OF_BOUND is returned when the PoA
+// setup cell is not in cell deps.
+int locate_poa_setup_cell_dep(const uint8_t *type_hash, size_t *index) {
+  size_t current = 0;
+  while (current < SIZE_MAX) {
+    uint64_t len = 32;
+    uint8_t hash[32] __attribute__((aligned(8)));
+
+    int ret = ckb_load_cell_by_field(hash, &len, 0, current,
+                                     CKB_SOURCE_CELL_DEP,
+                                     CKB_CELL_FIELD_TYPE_HASH);
+    if (ret == CKB_SUCCESS) {
+      if (len == 32 && hash_equal(type_hash, hash)) {
+        *index = current;
+        return CKB_SUCCESS;
+      }
+    } else if (ret != CKB_ITEM_MISSING) {
       return ret;
     }
+    current++;
+  }
+  return CKB_INDEX_OUT_OF_BOUND;
+}
 
-    size_t input_poa_data_cell_index = SIZE_MAX;
-    ret = look_for_poa_cell(&args_bytes_seg.ptr[32], CKB_SOURCE_INPUT,
-                            &input_poa_data_cell_index);
-    if (ret != CKB_SUCCESS) {
-      return ret;
+// PoA witness layout: the lock field of WitnessArgs in the first witness of
+// current script group is optional. When present, it contains a series of
+// entries, each consisting of 1 byte tag, 2 byte little endian payload length,
+// then the payload. A tag can appear at most once.
+//
+// Cell index hints for normal mode: index of the setup cell in cell deps,
+// then for each data cell in script args, its index in inputs and outputs,
+// each a little endian uint32_t.
+#define POA_WITNESS_TAG_NORMAL_HINTS 1
+// Cell index hints for consensus mode: index of the setup cell in inputs and
+// outputs, each a little endian uint32_t.
+#define POA_WITNESS_TAG_CONSENSUS_HINTS 2
+// Batch of subblocks committed in current transaction in normal mode: the
+// subtime of each subblock as a little endian uint64_t, in order. The last one
+// is the subblock recorded in the output PoA data cell.
+#define POA_WITNESS_TAG_BATCH 3
+// Recoverable secp256k1 signature of current aggregator, used when the setup
+// has signature identities. See calculate_signing_message for the message.
+#define POA_WITNESS_TAG_SIGNATURE 4
+// Approvals of a setup update in consensus mode, used when the setup has
+// signature identities: a bitmap with one bit per aggregator, little endian
+// bit order, then one recoverable signature for each set bit, in the order of
+// aggregator indices. Exactly aggregator change threshold bits must be set.
+#define POA_WITNESS_TAG_MULTISIG 5
+// Merkle proofs of identities, used when the setup has Merkle identities.
+// Each proof consists of aggregator index as little endian uint16_t, the
+// identity, then sibling hashes from leaf level up to the root. In normal mode,
+// a proof is needed for each aggregator issuing subblocks. In consensus mode,
+// one proof is needed for each approving aggregator, sorted by aggregator
+// index, and with signature identities, the multisig entry then contains only
+// signatures in the same order, without a bitmap.
+#define POA_WITNESS_TAG_MERKLE_PROOFS 6
+// Index of the header dep providing subtime, as a little endian uint32_t, used
+// when the setup has header time. Header dep 0 is used when missing.
+#define POA_WITNESS_TAG_HEADER_DEP 7
+#define POA_WITNESS_MAX_TAG 7
+
+typedef struct {
+  const uint8_t *entries[POA_WITNESS_MAX_TAG + 1];
+  size_t entry_lengths[POA_WITNESS_MAX_TAG + 1];
+} PoAWitness;
+
+uint32_t read_uint32(const uint8_t *source) {
+  uint32_t value;
+  memcpy(&value, source, 4);
+  return value;
+}
+
+uint64_t read_uint64(const uint8_t *source) {
+  uint64_t value;
+  memcpy(&value, source, 8);
+  return value;
+}
+
+int parse_poa_witness(const uint8_t *source_data, size_t source_length,
+                      PoAWitness *output) {
+  for (size_t i = 0; i <= POA_WITNESS_MAX_TAG; i++) {
+    output->entries[i] = NULL;
+    output->entry_lengths[i] = 0;
+  }
+  size_t offset = 0;
+  while (offset < source_length) {
+    if (source_length - offset < 3) {
+      DEBUG("Invalid PoA witness entry!");
+      return ERROR_ENCODING;
     }
-    uint8_t input_poa_data_buffer[22];
-    len = 22;
-    ret = ckb_load_cell_data(input_poa_data_buffer, &len, 0,
-                             input_poa_data_cell_index, CKB_SOURCE_INPUT);
-    if (ret != CKB_SUCCESS) {
-      return ret;
+    uint8_t tag = source_data[offset];
+    size_t length = (size_t)source_data[offset + 1] |
+                    ((size_t)source_data[offset + 2] << 8);
+    offset += 3;
+    if (tag == 0 || tag > POA_WITNESS_MAX_TAG ||
+        output->entries[tag] != NULL) {
+      DEBUG("Invalid PoA witness tag!");
+      return ERROR_ENCODING;
     }
-    if (len != 22) {
-      DEBUG("Invalid input poa data cell!");
+    if (source_length - offset < length) {
+      DEBUG("Invalid PoA witness entry!");
       return ERROR_ENCODING;
     }
-    const uint8_t *last_subblock_info = input_poa_data_buffer;
-
-    size_t output_poa_data_cell_index = SIZE_MAX;
-    ret = look_for_poa_cell(&args_bytes_seg.ptr[32], CKB_SOURCE_OUTPUT,
-                            &output_poa_data_cell_index);
+    output->entries[tag] = &source_data[offset];
+    output->entry_lengths[tag] = length;
+    offset += length;
+  }
+  if (output->entries[POA_WITNESS_TAG_NORMAL_HINTS] != NULL &&
+      (output->entry_lengths[POA_WITNESS_TAG_NORMAL_HINTS] < 12 ||
+       (output->entry_lengths[POA_WITNESS_TAG_NORMAL_HINTS] - 4) % 8 != 0)) {
+    DEBUG("Invalid normal mode hints!");
+    return ERROR_ENCODING;
+  }
+  if (output->entries[POA_WITNESS_TAG_CONSENSUS_HINTS] != NULL &&
+      output->entry_lengths[POA_WITNESS_TAG_CONSENSUS_HINTS] != 8) {
+    DEBUG("Invalid consensus mode hints!");
+    return ERROR_ENCODING;
+  }
+  if (output->entries[POA_WITNESS_TAG_BATCH] != NULL &&
+      (output->entry_lengths[POA_WITNESS_TAG_BATCH] == 0 ||
+       output->entry_lengths[POA_WITNESS_TAG_BATCH] % 8 != 0)) {
+    DEBUG("Invalid subblock batch!");
+    return ERROR_ENCODING;
+  }
+  if (output->entries[POA_WITNESS_TAG_SIGNATURE] != NULL &&
+      output->entry_lengths[POA_WITNESS_TAG_SIGNATURE] != SIGNATURE_SIZE) {
+    DEBUG("Invalid signature!");
+    return ERROR_ENCODING;
+  }
+  if (output->entries[POA_WITNESS_TAG_HEADER_DEP] != NULL &&
+      output->entry_lengths[POA_WITNESS_TAG_HEADER_DEP] != 4) {
+    DEBUG("Invalid header dep index!");
+    return ERROR_ENCODING;
+  }
+  if (output->entries[POA_WITNESS_TAG_NORMAL_HINTS] != NULL &&
+      output->entries[POA_WITNESS_TAG_CONSENSUS_HINTS] != NULL) {
+    DEBUG("Normal and consensus mode hints cannot be used together!");
+    return ERROR_ENCODING;
+  }
+  return CKB_SUCCESS;
+}
+
+// WitnessArgs header: total size, then offsets of lock, input_type and
+// output_type, each a little endian uint32_t.
+#define WITNESS_ARGS_HEADER_SIZE 16
+
+// Loads the lock field of the first witness in current script group into
+// buffer and parses it as PoA witness. Only the lock field is loaded, so other
+// scripts can keep large payloads in input_type or output_type. A missing or
+// empty witness, a witness that is not a WitnessArgs, or a WitnessArgs without
+// lock field, results in an empty PoAWitness.
+int load_poa_witness(uint8_t *buffer, uint64_t buffer_size,
+                     PoAWitness *output) {
+  uint8_t header[WITNESS_ARGS_HEADER_SIZE];
+  uint64_t len = WITNESS_ARGS_HEADER_SIZE;
+  int ret = ckb_load_witness(header, &len, 0, 0, CKB_SOURCE_GROUP_INPUT);
+  if (ret == CKB_INDEX_OUT_OF_BOUND) {
+    return parse_poa_witness(buffer, 0, output);
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint64_t witness_length = len;
+  if (witness_length < WITNESS_ARGS_HEADER_SIZE) {
+    return parse_poa_witness(buffer, 0, output);
+  }
+  uint64_t lock_start = read_uint32(&header[4]);
+  uint64_t lock_end = read_uint32(&header[8]);
+  if (read_uint32(header) != witness_length ||
+      lock_start != WITNESS_ARGS_HEADER_SIZE || lock_end < lock_start ||
+      lock_end > witness_length || lock_end - lock_start < 4) {
+    // Not a WitnessArgs, or the lock field is missing
+    return parse_poa_witness(buffer, 0, output);
+  }
+  uint64_t lock_length = lock_end - lock_start;
+  if (lock_length > buffer_size) {
+    DEBUG("PoA witness is too large!");
+    return ERROR_ENCODING;
+  }
+  len = lock_length;
+  ret = ckb_load_witness(buffer, &len, lock_start, 0, CKB_SOURCE_GROUP_INPUT);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  // len is the remaining length from lock_start, which covers lock_length as
+  // validated above.
+  if (len < lock_length || read_uint32(buffer) != lock_length - 4) {
+    return parse_poa_witness(buffer, 0, output);
+  }
+  return parse_poa_witness(&buffer[4], lock_length - 4, output);
+}
+
+// Identities form a binary Merkle tree with the first identity as the left
+// most leaf. A leaf is blake2b(0x00 || identity), a parent node is
+// blake2b(0x01 || left || right). When aggregator number is not a power of 2,
+// missing leaves in the last subtrees can be anything, 32 zero bytes are used
+// by convention.
+int verify_merkle_proof(const PoASetup *poa_setup, const uint8_t *proof,
+                        uint16_t *aggregator_index) {
+  *aggregator_index = (uint16_t)proof[0] | ((uint16_t)proof[1] << 8);
+  if (*aggregator_index >= SETUP_AGGREGATOR_NUMBER(poa_setup)) {
+    DEBUG("Invalid Merkle proof index!");
+    return ERROR_ENCODING;
+  }
+  const uint8_t *identity = &proof[2];
+  const uint8_t *siblings = &proof[2 + SETUP_IDENTITY_SIZE(poa_setup)];
+  uint8_t prefix = 0;
+  uint8_t hash[32] __attribute__((aligned(8)));
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, 32);
+  blake2b_update(&blake2b_ctx, &prefix, 1);
+  blake2b_update(&blake2b_ctx, identity, SETUP_IDENTITY_SIZE(poa_setup));
+  blake2b_final(&blake2b_ctx, hash, 32);
+
+  prefix = 1;
+  size_t index = *aggregator_index;
+  size_t depth = merkle_depth(poa_setup);
+  for (size_t i = 0; i < depth; i++) {
+    blake2b_init(&blake2b_ctx, 32);
+    blake2b_update(&blake2b_ctx, &prefix, 1);
+    if ((index & 1) == 0) {
+      blake2b_update(&blake2b_ctx, hash, 32);
+      blake2b_update(&blake2b_ctx, &siblings[i * 32], 32);
+    } else {
+      blake2b_update(&blake2b_ctx, &siblings[i * 32], 32);
+      blake2b_update(&blake2b_ctx, hash, 32);
+    }
+    blake2b_final(&blake2b_ctx, hash, 32);
+    index >>= 1;
+  }
+  if (!hash_equal(hash, poa_setup->merkle_root)) {
+    DEBUG("Invalid Merkle proof!");
+    return ERROR_ENCODING;
+  }
+  return CKB_SUCCESS;
+}
+
+// Loads identity of the aggregator at aggregator_index, either from
+// identities stored in the PoA setup cell at index of source, or from a Merkle
+// proof in the PoA witness.
+int load_aggregator_identity(const PoASetup *poa_setup, size_t index,
+                             size_t source, const PoAWitness *witness,
+                             size_t aggregator_index, uint8_t *identity) {
+  if (!SETUP_MERKLE_IDENTITIES(poa_setup)) {
+    return load_setup_identities(poa_setup, index, source, aggregator_index, 1,
+                                 identity);
+  }
+  const uint8_t *proofs = witness->entries[POA_WITNESS_TAG_MERKLE_PROOFS];
+  size_t proof_size = merkle_proof_size(poa_setup);
+  size_t proofs_length = witness->entry_lengths[POA_WITNESS_TAG_MERKLE_PROOFS];
+  if (proofs == NULL || proofs_length % proof_size != 0) {
+    DEBUG("Invalid Merkle proofs!");
+    return ERROR_ENCODING;
+  }
+  for (size_t offset = 0; offset < proofs_length; offset += proof_size) {
+    const uint8_t *proof = &proofs[offset];
+    if (((size_t)proof[0] | ((size_t)proof[1] << 8)) != aggregator_index) {
+      continue;
+    }
+    uint16_t proof_index = 0;
+    int ret = verify_merkle_proof(poa_setup, proof, &proof_index);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    memcpy(identity, &proof[2], SETUP_IDENTITY_SIZE(poa_setup));
+    return CKB_SUCCESS;
+  }
+  DEBUG("Missing Merkle proof!");
+  return ERROR_ENCODING;
+}
+
+// The message signed by aggregators: blake2b hash of current transaction hash,
+// followed by all entries in the PoA witness other than signatures, in the
+// order of tags, each serialized the same way as in the witness. This way the
+// signature also commits to hints and subblock batch.
+void calculate_signing_message(const uint8_t *tx_hash,
+                               const PoAWitness *witness, uint8_t *message) {
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, 32);
+  blake2b_update(&blake2b_ctx, tx_hash, 32);
+  for (uint8_t tag = 1; tag <= POA_WITNESS_MAX_TAG; tag++) {
+    if (tag == POA_WITNESS_TAG_SIGNATURE || tag == POA_WITNESS_TAG_MULTISIG ||
+        witness->entries[tag] == NULL) {
+      continue;
+    }
+    size_t length = witness->entry_lengths[tag];
+    uint8_t entry_header[3];
+    entry_header[0] = tag;
+    entry_header[1] = length & 0xFF;
+    entry_header[2] = (length >> 8) & 0xFF;
+    blake2b_update(&blake2b_ctx, entry_header, 3);
+    blake2b_update(&blake2b_ctx, witness->entries[tag], length);
+  }
+  blake2b_final(&blake2b_ctx, message, 32);
+}
+
+// Signature verification and consensus mode with Merkle identities are only
+// used by the PoA lock itself, the dual build leaves them out together with
+// their buffers.
+#ifndef POA_DUAL_LIBRARY
+typedef int (*LoadPrefilledDataFn)(void *data, size_t *len);
+typedef int (*ValidateSignatureFn)(void *prefilled_data,
+                                   const uint8_t *signature_buffer,
+                                   size_t signature_size,
+                                   const uint8_t *message_buffer,
+                                   size_t message_size, uint8_t *output,
+                                   size_t *output_len);
+
+// Kept out of the stack for their sizes, the code buffer must also be page
+// aligned for dynamic loading.
+static uint8_t code_buffer[CODE_SIZE] __attribute__((aligned(RISCV_PGSIZE)));
+static uint8_t prefilled_data_buffer[PREFILLED_DATA_SIZE];
+
+typedef struct {
+  ValidateSignatureFn validate_signature;
+  uint8_t message[32];
+} SignatureVerifier;
+
+// Loads the signature library specified in the PoA setup cell at index of
+// source, and prepares the message all signatures must sign.
+int load_signature_verifier(const PoASetup *poa_setup, size_t index,
+                            size_t source, const PoAWitness *witness,
+                            SignatureVerifier *verifier) {
+  uint8_t code_hash[32];
+  uint64_t len = 32;
+  int ret = ckb_load_cell_data(code_hash, &len, poa_setup->extension_offset,
+                               index, source);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len < 32) {
+    DEBUG("Invalid signature library hash!");
+    return ERROR_ENCODING;
+  }
+
+  void *handle = NULL;
+  size_t consumed_size = 0;
+  ret = ckb_dlopen(code_hash, code_buffer, CODE_SIZE, &handle, &consumed_size);
+  if (ret != CKB_SUCCESS) {
+    DEBUG("Error loading signature library!");
+    return ERROR_DYNAMIC_LOADING;
+  }
+  LoadPrefilledDataFn load_prefilled_data =
+      (LoadPrefilledDataFn)ckb_dlsym(handle, "load_prefilled_data");
+  verifier->validate_signature =
+      (ValidateSignatureFn)ckb_dlsym(handle, "validate_signature");
+  if (load_prefilled_data == NULL || verifier->validate_signature == NULL) {
+    DEBUG("Error loading signature library functions!");
+    return ERROR_DYNAMIC_LOADING;
+  }
+  size_t prefilled_data_len = PREFILLED_DATA_SIZE;
+  ret = load_prefilled_data(prefilled_data_buffer, &prefilled_data_len);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+
+  uint8_t tx_hash[32];
+  len = 32;
+  ret = ckb_load_tx_hash(tx_hash, &len, 0);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len != 32) {
+    DEBUG("Invalid transaction hash!");
+    return ERROR_ENCODING;
+  }
+  calculate_signing_message(tx_hash, witness, verifier->message);
+  return CKB_SUCCESS;
+}
+
+// Recovers the public key hash of the signer of signature, at least
+// identity_size bytes are guaranteed to be available in pubkey_hash.
+int recover_signer(const SignatureVerifier *verifier, const uint8_t *signature,
+                   size_t identity_size, uint8_t *pubkey_hash) {
+  size_t pubkey_hash_len = 32;
+  int ret = verifier->validate_signature(prefilled_data_buffer, signature,
+                                         SIGNATURE_SIZE, verifier->message, 32,
+                                         pubkey_hash, &pubkey_hash_len);
+  if (ret != CKB_SUCCESS) {
+    DEBUG("Invalid aggregator signature!");
+    return ret;
+  }
+  if (pubkey_hash_len < identity_size) {
+    DEBUG("Invalid public key hash!");
+    return ERROR_ENCODING;
+  }
+  return CKB_SUCCESS;
+}
+
+// Validates that enough aggregators listed in the PoA setup cell at index of
+// source approve current transaction via signatures in the PoA witness. Only
+// identities of the approving aggregators are loaded, so the cost is bounded
+// by aggregator change threshold.
+int validate_consensus_multisig(const PoASetup *poa_setup, size_t index,
+                                size_t source, const PoAWitness *witness) {
+  const uint8_t *multisig = witness->entries[POA_WITNESS_TAG_MULTISIG];
+  if (multisig == NULL) {
+    DEBUG("Missing aggregator approvals!");
+    return ERROR_ENCODING;
+  }
+  size_t bitmap_size = ((size_t)SETUP_AGGREGATOR_NUMBER(poa_setup) + 7) / 8;
+  size_t threshold = poa_setup->aggregator_change_threshold;
+  if (threshold == 0 || witness->entry_lengths[POA_WITNESS_TAG_MULTISIG] !=
+                            bitmap_size + threshold * SIGNATURE_SIZE) {
+    DEBUG("Invalid aggregator approvals!");
+    return ERROR_ENCODING;
+  }
+  size_t approvals = 0;
+  for (size_t i = 0; i < bitmap_size * 8; i++) {
+    if (((multisig[i / 8] >> (i % 8)) & 1) == 0) {
+      continue;
+    }
+    if (i >= SETUP_AGGREGATOR_NUMBER(poa_setup)) {
+      DEBUG("Invalid aggregator approvals!");
+      return ERROR_ENCODING;
+    }
+    approvals++;
+  }
+  if (approvals != threshold) {
+    DEBUG("Not enough aggregator approvals!");
+    return ERROR_ENCODING;
+  }
+
+  SignatureVerifier verifier;
+  int ret =
+      load_signature_verifier(poa_setup, index, source, witness, &verifier);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  const uint8_t *signature = &multisig[bitmap_size];
+  for (size_t i = 0; i < SETUP_AGGREGATOR_NUMBER(poa_setup); i++) {
+    if (((multisig[i / 8] >> (i % 8)) & 1) == 0) {
+      continue;
+    }
+    uint8_t identity[IDENTITY_SIZE];
+    ret = load_setup_identities(poa_setup, index, source, i, 1, identity);
     if (ret != CKB_SUCCESS) {
       return ret;
     }
-    uint8_t output_poa_data_buffer[22];
-    len = 22;
-    ret = ckb_load_cell_data(output_poa_data_buffer, &len, 0,
-                             output_poa_data_cell_index, CKB_SOURCE_OUTPUT);
+    uint8_t signer[32];
+    ret = recover_signer(&verifier, signature, SETUP_IDENTITY_SIZE(poa_setup),
+                         signer);
     if (ret != CKB_SUCCESS) {
       return ret;
     }
-    if (len != 22) {
-      DEBUG("Invalid output poa data cell!");
+    if (!hash_prefix_equal(signer, identity, SETUP_IDENTITY_SIZE(poa_setup))) {
+      DEBUG("Approval is not signed by the aggregator!");
       return ERROR_ENCODING;
     }
-    const uint8_t *current_subblock_info = output_poa_data_buffer;
-
-    // Check that current aggregator is indeed due to issuing new block.
-    uint64_t last_round_initial_subtime = *((uint64_t *)last_subblock_info);
-    uint64_t last_subblock_subtime = *((uint64_t *)(&last_subblock_info[8]));
-    uint32_t last_block_index = *((uint32_t *)(&last_subblock_info[16]));
-    uint16_t last_aggregator_index = *((uint16_t *)(&last_subblock_info[20]));
-
-    uint64_t current_round_initial_subtime =
-        *((uint64_t *)current_subblock_info);
-    uint64_t current_subblock_subtime =
-        *((uint64_t *)(&current_subblock_info[8]));
-    uint32_t current_subblock_index =
-        *((uint32_t *)(&current_subblock_info[16]));
-    uint16_t current_aggregator_index =
-        *((uint16_t *)(&current_subblock_info[20]));
-    if (current_aggregator_index >= poa_setup.aggregator_number) {
-      DEBUG("Invalid aggregator index!");
+    signature += SIGNATURE_SIZE;
+  }
+  return CKB_SUCCESS;
+}
+
+// Validates that enough aggregators committed in the Merkle root of the PoA
+// setup cell at index of source approve current transaction. Approving
+// identities are taken from Merkle proofs in the witness, then authorized by
+// signatures, or owner cells when identities are lock script hashes.
+int validate_consensus_merkle(InputArena *arena, const PoASetup *poa_setup,
+                              size_t index, size_t source,
+                              const PoAWitness *witness) {
+  const uint8_t *proofs = witness->entries[POA_WITNESS_TAG_MERKLE_PROOFS];
+  size_t proof_size = merkle_proof_size(poa_setup);
+  size_t threshold = poa_setup->aggregator_change_threshold;
+  if (threshold == 0 || proofs == NULL ||
+      witness->entry_lengths[POA_WITNESS_TAG_MERKLE_PROOFS] !=
+          threshold * proof_size) {
+    DEBUG("Invalid Merkle proofs!");
+    return ERROR_ENCODING;
+  }
+  const uint8_t *signatures = NULL;
+  SignatureVerifier verifier;
+  if (poa_setup->signature_identities) {
+    signatures = witness->entries[POA_WITNESS_TAG_MULTISIG];
+    if (signatures == NULL ||
+        witness->entry_lengths[POA_WITNESS_TAG_MULTISIG] !=
+            threshold * SIGNATURE_SIZE) {
+      DEBUG("Invalid aggregator approvals!");
       return ERROR_ENCODING;
     }
-
-    // Since is used to ensure aggregators wait till the correct time.
-    uint64_t since = 0;
-    len = 8;
-    ret =
-        ckb_load_input_by_field(((uint8_t *)&since), &len, 0, 0,
-                                CKB_SOURCE_GROUP_INPUT, CKB_INPUT_FIELD_SINCE);
+    int ret =
+        load_signature_verifier(poa_setup, index, source, witness, &verifier);
     if (ret != CKB_SUCCESS) {
       return ret;
     }
-    if (len != 8) {
-      DEBUG("Invalid loading since!");
+  }
+  uint16_t last_aggregator_index = 0;
+  for (size_t i = 0; i < threshold; i++) {
+    const uint8_t *proof = &proofs[i * proof_size];
+    uint16_t aggregator_index = 0;
+    int ret = verify_merkle_proof(poa_setup, proof, &aggregator_index);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    // Sorted indices ensure each aggregator approves at most once
+    if (i > 0 && aggregator_index <= last_aggregator_index) {
+      DEBUG("Merkle proofs must be sorted by aggregator index!");
       return ERROR_ENCODING;
     }
-    if (poa_setup.round_interval_uses_seconds) {
-      if (since >> 56 != 0x40) {
-        DEBUG("PoA requires absolute timestamp since!");
+    last_aggregator_index = aggregator_index;
+    const uint8_t *identity = &proof[2];
+    if (poa_setup->signature_identities) {
+      uint8_t signer[32];
+      ret = recover_signer(&verifier, &signatures[i * SIGNATURE_SIZE],
+                           SETUP_IDENTITY_SIZE(poa_setup), signer);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      if (!hash_prefix_equal(signer, identity,
+                             SETUP_IDENTITY_SIZE(poa_setup))) {
+        DEBUG("Approval is not signed by the aggregator!");
         return ERROR_ENCODING;
       }
     } else {
-      if (since >> 56 != 0) {
-        DEBUG("PoA requires absolute block number since!");
+      // The Merkle root cannot rule out repeated identities, so each
+      // approval by the same identity needs its own owner cell.
+      size_t skip = 0;
+      for (size_t j = 0; j < i; j++) {
+        if (hash_prefix_equal(&proofs[j * proof_size + 2], identity,
+                              SETUP_IDENTITY_SIZE(poa_setup))) {
+          skip++;
+        }
+      }
+      ret = validate_distinct_signing(arena, identity,
+                                      SETUP_IDENTITY_SIZE(poa_setup), skip);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+    }
+  }
+  return CKB_SUCCESS;
+}
+#endif /* POA_DUAL_LIBRARY */
+
+// Validates the transition of one PoA data cell from last_subblock_info to
+// current_subblock_info, both being 22 byte PoA data. since is the since value
+// shared by all PoA cells without flags, batch holds subtimes of a batch of
+// subblocks if present. The index of the aggregator issuing current subblock
+// is returned via aggregator_index.
+int validate_subblock_transition(const PoASetup *poa_setup,
+                                 const uint8_t *last_subblock_info,
+                                 const uint8_t *current_subblock_info,
+                                 uint64_t since, const uint8_t *batch,
+                                 size_t batch_length,
+                                 uint16_t *aggregator_index) {
+  // Check that current aggregator is indeed due to issuing new block.
+  uint64_t last_round_initial_subtime = *((uint64_t *)last_subblock_info);
+  uint64_t last_subblock_subtime = *((uint64_t *)(&last_subblock_info[8]));
+  uint32_t last_block_index = *((uint32_t *)(&last_subblock_info[16]));
+  uint16_t last_aggregator_index = *((uint16_t *)(&last_subblock_info[20]));
+
+  uint64_t current_round_initial_subtime = *((uint64_t *)current_subblock_info);
+  uint64_t current_subblock_subtime =
+      *((uint64_t *)(&current_subblock_info[8]));
+  uint32_t current_subblock_index = *((uint32_t *)(&current_subblock_info[16]));
+  uint16_t current_aggregator_index =
+      *((uint16_t *)(&current_subblock_info[20]));
+  if (current_aggregator_index >= SETUP_AGGREGATOR_NUMBER(poa_setup)) {
+    DEBUG("Invalid aggregator index!");
+    return ERROR_ENCODING;
+  }
+  if (current_subblock_subtime != since) {
+    DEBUG("Invalid current time!");
+    return ERROR_ENCODING;
+  }
+
+  // One transaction can commit a batch of subblocks at once, in which case
+  // subtimes of all subblocks are provided in the witness, the last one
+  // being current subblock. Without a batch, only current subblock is
+  // committed.
+  uint64_t batch_size = 1;
+  uint64_t first_subblock_subtime = current_subblock_subtime;
+  if (batch != NULL) {
+    batch_size = batch_length / 8;
+    first_subblock_subtime = read_uint64(batch);
+    for (size_t i = 1; i < batch_size; i++) {
+      if (read_uint64(&batch[i * 8]) < read_uint64(&batch[(i - 1) * 8])) {
+        DEBUG("Batch subtimes must be non-decreasing!");
         return ERROR_ENCODING;
       }
     }
-    since &= 0x00FFFFFFFFFFFFFF;
-    if (current_subblock_subtime != since) {
-      DEBUG("Invalid current time!");
+    if (read_uint64(&batch[(batch_size - 1) * 8]) != current_subblock_subtime) {
+      DEBUG("Invalid batch subtime!");
       return ERROR_ENCODING;
     }
+  }
 
-    // There are 2 supporting modes:
-    // 1. An aggregator can issue as much new blocks as it wants as long as
-    // round_intervals and subblocks_per_round requirement is met.
-    // 2. When the round_intervals duration has passed, the next aggregator
-    // should now be able to issue more blocks.
-    if (since < last_round_initial_subtime + poa_setup.round_intervals) {
-      // Current aggregator is issuing blocks
-      if (current_round_initial_subtime != last_round_initial_subtime) {
-        DEBUG("Invalid current round first timestamp!");
-        return ERROR_ENCODING;
-      }
-      // Timestamp must be non-decreasing
-      if (current_subblock_subtime < last_subblock_subtime) {
-        DEBUG("Invalid current timestamp!");
-        return ERROR_ENCODING;
-      }
-      if (current_aggregator_index != last_aggregator_index) {
-        DEBUG("Invalid aggregator!");
-        return ERROR_ENCODING;
-      }
-      if ((current_subblock_index != last_block_index + 1) ||
-          (current_subblock_index >= poa_setup.subblocks_per_round)) {
-        DEBUG("Invalid block index");
-        return ERROR_ENCODING;
-      }
-    } else {
-      if (current_round_initial_subtime != current_subblock_subtime) {
-        DEBUG("Invalid current round first timestamp!");
+  // There are 2 supporting modes:
+  // 1. An aggregator can issue as much new blocks as it wants as long as
+  // round_intervals and subblocks_per_round requirement is met.
+  // 2. When the round_intervals duration has passed, the next aggregator
+  // should now be able to issue more blocks.
+  // With early handoff, a round using up subblocks_per_round is closed, the
+  // next aggregator can then start its round without waiting.
+  int round_closed =
+      poa_setup->early_handoff &&
+      (uint64_t)last_block_index + 1 >= poa_setup->subblocks_per_round;
+  // With an overlap window, the next aggregator can open its round once the
+  // window starts, and a subblock committed within the window closes the
+  // round.
+  uint64_t round_end_subtime =
+      last_round_initial_subtime + (uint64_t)poa_setup->round_intervals;
+  uint64_t overlap_start_subtime =
+      round_end_subtime - (uint64_t)poa_setup->overlap_window;
+  int in_overlap = poa_setup->overlap_window > 0 &&
+                   since >= overlap_start_subtime &&
+                   current_aggregator_index != last_aggregator_index;
+  if (poa_setup->overlap_window > 0 &&
+      last_subblock_subtime >= overlap_start_subtime) {
+    round_closed = 1;
+  }
+  if ((!round_closed) && (!in_overlap) && since < round_end_subtime) {
+    // Current aggregator is issuing blocks
+    if (current_round_initial_subtime != last_round_initial_subtime) {
+      DEBUG("Invalid current round first timestamp!");
+      return ERROR_ENCODING;
+    }
+    // Timestamp must be non-decreasing
+    if (first_subblock_subtime < last_subblock_subtime) {
+      DEBUG("Invalid current timestamp!");
+      return ERROR_ENCODING;
+    }
+    if (current_aggregator_index != last_aggregator_index) {
+      DEBUG("Invalid aggregator!");
+      return ERROR_ENCODING;
+    }
+    if (((uint64_t)current_subblock_index !=
+         (uint64_t)last_block_index + batch_size) ||
+        (current_subblock_index >= poa_setup->subblocks_per_round)) {
+      DEBUG("Invalid block index");
+      return ERROR_ENCODING;
+    }
+    if (poa_setup->overlap_window > 0 && since >= overlap_start_subtime &&
+        batch_size > 1) {
+      DEBUG("Only one subblock can be committed in overlap window!");
+      return ERROR_ENCODING;
+    }
+  } else {
+    if (current_round_initial_subtime != first_subblock_subtime) {
+      DEBUG("Invalid current round first timestamp!");
+      return ERROR_ENCODING;
+    }
+    if ((uint64_t)current_subblock_index != batch_size - 1) {
+      DEBUG("Invalid block index");
+      return ERROR_ENCODING;
+    }
+    if (batch_size > 1) {
+      // The whole batch must fit in the new round
+      if ((current_subblock_index >= poa_setup->subblocks_per_round) ||
+          (since >= current_round_initial_subtime +
+                        (uint64_t)poa_setup->round_intervals)) {
+        DEBUG("Batch exceeds current round!");
         return ERROR_ENCODING;
       }
-      if (current_subblock_index != 0) {
-        DEBUG("Invalid block index");
+    }
+    // Next aggregator in place
+    uint64_t lane_count = (uint64_t)poa_setup->lane_count;
+    uint64_t lane_size = (uint64_t)SETUP_AGGREGATOR_NUMBER(poa_setup);
+    uint64_t current_position = (uint64_t)current_aggregator_index;
+    uint64_t last_position = (uint64_t)last_aggregator_index;
+    if (lane_count > 1) {
+      // Aggregators only take turns within the lane of current PoA data
+      // cell, so positions and steps are counted within the lane.
+      uint64_t lane = last_position % lane_count;
+      if (current_position % lane_count != lane) {
+        DEBUG("Invalid lane!");
         return ERROR_ENCODING;
       }
-      // Next aggregator in place
-      uint64_t steps = (((uint64_t)current_aggregator_index +
-                         (uint64_t)poa_setup.aggregator_number -
-                         (uint64_t)last_aggregator_index) %
-                        (uint64_t)poa_setup.aggregator_number);
-      if (steps == 0) {
-        steps = (uint64_t)poa_setup.aggregator_number;
-      }
-      uint64_t duration = steps * ((uint64_t)poa_setup.round_intervals);
-      if (since < duration + last_round_initial_subtime) {
-        DEBUG("Invalid time!");
-        return ERROR_ENCODING;
+      lane_size = (lane_size - lane + lane_count - 1) / lane_count;
+      current_position /= lane_count;
+      last_position /= lane_count;
+    }
+    uint64_t steps =
+        (current_position + lane_size - last_position) % lane_size;
+    if (steps == 0) {
+      steps = lane_size;
+    }
+    uint64_t duration = steps * ((uint64_t)poa_setup->round_intervals);
+    uint64_t earliest_subtime = duration + last_round_initial_subtime;
+    if (steps == 1 && current_aggregator_index != last_aggregator_index) {
+      // Only the next aggregator takes over early, skipped aggregators still
+      // get their full rounds. Subtimes are kept non-decreasing.
+      earliest_subtime -= (uint64_t)poa_setup->overlap_window;
+      if (round_closed || earliest_subtime < last_subblock_subtime) {
+        earliest_subtime = last_subblock_subtime;
       }
     }
+    if (first_subblock_subtime < earliest_subtime) {
+      DEBUG("Invalid time!");
+      return ERROR_ENCODING;
+    }
+  }
+  *aggregator_index = current_aggregator_index;
+  return CKB_SUCCESS;
+}
 
-    return validate_single_signing(
-        &poa_setup.identities[(size_t)current_aggregator_index *
-                              (size_t)poa_setup.identity_size],
-        poa_setup.identity_size);
+// Same as validate_subblock_transition, but loads PoA data from the input at
+// input_index and the output at output_index.
+int validate_subblock(const PoASetup *poa_setup, size_t input_index,
+                      size_t output_index, uint64_t since,
+                      const uint8_t *batch, size_t batch_length,
+                      uint16_t *aggregator_index) {
+  uint8_t input_poa_data_buffer[22];
+  uint64_t len = 22;
+  int ret = ckb_load_cell_data(input_poa_data_buffer, &len, 0, input_index,
+                               CKB_SOURCE_INPUT);
+  if (ret != CKB_SUCCESS) {
+    return ret;
   }
-  // PoA consensus mode
-  size_t input_poa_setup_cell_index = SIZE_MAX;
-  ret = look_for_poa_cell(args_bytes_seg.ptr, CKB_SOURCE_INPUT,
-                          &input_poa_setup_cell_index);
+  if (len != 22) {
+    DEBUG("Invalid input poa data cell!");
+    return ERROR_ENCODING;
+  }
+
+  uint8_t output_poa_data_buffer[22];
+  len = 22;
+  ret = ckb_load_cell_data(output_poa_data_buffer, &len, 0, output_index,
+                           CKB_SOURCE_OUTPUT);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
-  uint8_t input_poa_setup_buffer[POA_BUFFER_SIZE];
-  uint64_t input_poa_setup_len = POA_BUFFER_SIZE;
-  ret = ckb_load_cell_data(input_poa_setup_buffer, &input_poa_setup_len, 0,
-                           input_poa_setup_cell_index, CKB_SOURCE_INPUT);
+  if (len != 22) {
+    DEBUG("Invalid output poa data cell!");
+    return ERROR_ENCODING;
+  }
+  return validate_subblock_transition(poa_setup, input_poa_data_buffer,
+                                      output_poa_data_buffer, since, batch,
+                                      batch_length, aggregator_index);
+}
+
+// Checks since flags required by PoA setup, and strips them from since.
+int check_poa_since(const PoASetup *poa_setup, uint64_t *since) {
+  if (poa_setup->round_interval_uses_seconds) {
+    if (*since >> 56 != 0x40) {
+      DEBUG("PoA requires absolute timestamp since!");
+      return ERROR_ENCODING;
+    }
+  } else {
+    if (*since >> 56 != 0) {
+      DEBUG("PoA requires absolute block number since!");
+      return ERROR_ENCODING;
+    }
+  }
+  *since &= 0x00FFFFFFFFFFFFFF;
+  return CKB_SUCCESS;
+}
+
+// Offset of timestamp in a serialized header, following version and
+// compact_target in RawHeader.
+#define HEADER_TIMESTAMP_OFFSET 8
+
+// Replaces since, already stripped of flags, with the timestamp in seconds of
+// the header dep selected by the PoA witness. since bounds how old the header
+// can be, while the header, being committed on chain, bounds how far subtime
+// can lead the actual time.
+int load_header_subtime(const PoASetup *poa_setup, const PoAWitness *witness,
+                        uint64_t *since) {
+  size_t index = 0;
+  if (witness->entries[POA_WITNESS_TAG_HEADER_DEP] != NULL) {
+    index = read_uint32(witness->entries[POA_WITNESS_TAG_HEADER_DEP]);
+  }
+  uint64_t timestamp = 0;
+  uint64_t len = 8;
+  int ret = ckb_load_header(&timestamp, &len, HEADER_TIMESTAMP_OFFSET, index,
+                            CKB_SOURCE_HEADER_DEP);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
-  if (input_poa_setup_len > POA_BUFFER_SIZE) {
-    DEBUG("Input PoA cell is too large!");
+  if (len < 8) {
+    DEBUG("Invalid header!");
+    return ERROR_ENCODING;
+  }
+  // Header timestamps are in milliseconds
+  timestamp /= 1000;
+  if (timestamp < *since ||
+      timestamp - *since > (uint64_t)poa_setup->max_header_age) {
+    DEBUG("Header dep is out of since range!");
     return ERROR_ENCODING;
   }
+  *since = timestamp;
+  return CKB_SUCCESS;
+}
+
+// Loads since shared by all PoA cells using current lock. Every PoA cell in
+// the group must use the same since value.
+int load_group_since(uint64_t *since) {
+  size_t current = 0;
+  while (current < SIZE_MAX) {
+    uint64_t current_since = 0;
+    uint64_t len = 8;
+    int ret = ckb_load_input_by_field(((uint8_t *)&current_since), &len, 0,
+                                      current, CKB_SOURCE_GROUP_INPUT,
+                                      CKB_INPUT_FIELD_SINCE);
+    if (ret == CKB_INDEX_OUT_OF_BOUND && current > 0) {
+      break;
+    }
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    if (len != 8) {
+      DEBUG("Invalid loading since!");
+      return ERROR_ENCODING;
+    }
+    if (current > 0 && current_since != *since) {
+      DEBUG("PoA cells must use the same since!");
+      return ERROR_ENCODING;
+    }
+    *since = current_since;
+    current++;
+  }
+  return CKB_SUCCESS;
+}
+
+// Kept out of the stack for its size.
+static InputArena input_arena;
+
+// Entry point of the dual build(build/$(ENVIRONMENT)/poa_dual), so a script
+// that already has the PoA setup and PoA data cells loaded, such as a layer 2
+// type script, can validate a subblock in process via ckb_dlopen, instead of
+// relying on a separate PoA lock execution loading them again.
+//
+// setup_data holds the whole PoA setup cell data, input_data and output_data
+// hold PoA data before and after current subblock, since is the since value of
+// the caller's PoA cell input, and batch optionally holds subtimes of a batch
+// of subblocks in the same format as the PoA witness. Locating those cells via
+// their type IDs is left to the caller. Only identities authorized via owner
+// cells and subtimes from since are supported, since signature and Merkle
+// identities, as well as header time, need the PoA witness.
+__attribute__((visibility("default"))) int validate_poa_subblock(
+    const uint8_t *setup_data, size_t setup_length, const uint8_t *input_data,
+    size_t input_data_length, const uint8_t *output_data,
+    size_t output_data_length, uint64_t since, const uint8_t *batch,
+    size_t batch_length) {
   PoASetup poa_setup;
-  ret =
-      parse_poa_setup(input_poa_setup_buffer, input_poa_setup_len, &poa_setup);
+  int ret = parse_poa_setup_header(setup_data, setup_length, &poa_setup);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
+  ret = parse_poa_setup_tail(setup_data, &setup_data[poa_setup.tail_offset],
+                             &poa_setup);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (poa_setup.signature_identities || poa_setup.merkle_identities ||
+      poa_setup.header_time) {
+    DEBUG("PoA setup requires PoA witness!");
+    return ERROR_ENCODING;
+  }
+  if (input_data_length != 22 || output_data_length != 22) {
+    DEBUG("Invalid poa data cell!");
+    return ERROR_ENCODING;
+  }
+  if (batch != NULL && (batch_length == 0 || batch_length % 8 != 0)) {
+    DEBUG("Invalid subblock batch!");
+    return ERROR_ENCODING;
+  }
+  ret = check_poa_since(&poa_setup, &since);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint16_t aggregator_index = 0;
+  ret = validate_subblock_transition(&poa_setup, input_data, output_data,
+                                     since, batch, batch_length,
+                                     &aggregator_index);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  init_input_arena(&input_arena);
+  return validate_single_signing(
+      &input_arena,
+      &setup_data[POA_SETUP_HEADER_SIZE +
+                  (size_t)aggregator_index * SETUP_IDENTITY_SIZE(&poa_setup)],
+      SETUP_IDENTITY_SIZE(&poa_setup));
+}
 
-  size_t output_poa_setup_cell_index = SIZE_MAX;
-  ret = look_for_poa_cell(args_bytes_seg.ptr, CKB_SOURCE_OUTPUT,
-                          &output_poa_setup_cell_index);
+#ifdef POA_DUAL_LIBRARY
+// The dual build is only meant to be loaded via ckb_dlopen, use
+// build/$(ENVIRONMENT)/poa as the PoA lock.
+int main() {
+  DEBUG("The dual build cannot be used as PoA lock!");
+  return ERROR_ENCODING;
+}
+#else
+// Kept out of the stack, since it is far larger than all other buffers used
+// here.
+static uint8_t witness_buffer[SIGNATURE_WITNESS_BUFFER_SIZE];
+
+int main() {
+  // Load current script so as to extract PoA cell information
+  unsigned char script[SCRIPT_BUFFER_SIZE];
+  uint64_t len = SCRIPT_BUFFER_SIZE;
+  int ret = ckb_checked_load_script(script, &len, 0);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
-  uint8_t output_poa_setup_buffer[POA_BUFFER_SIZE];
-  uint64_t output_poa_setup_len = POA_BUFFER_SIZE;
-  ret = ckb_load_cell_data(output_poa_setup_buffer, &output_poa_setup_len, 0,
-                           output_poa_setup_cell_index, CKB_SOURCE_OUTPUT);
+
+  mol_seg_t script_seg;
+  script_seg.ptr = (uint8_t *)script;
+  script_seg.size = len;
+  if (MolReader_Script_verify(&script_seg, false) != MOL_OK) {
+    DEBUG("molecule verification failure!");
+    return ERROR_ENCODING;
+  }
+  mol_seg_t args_seg = MolReader_Script_get_args(&script_seg);
+  mol_seg_t args_bytes_seg = MolReader_Bytes_raw_bytes(&args_seg);
+
+#ifdef POA_WITH_STATE_LOCK
+  // State lock args only contain the PoA lock hash, while PoA lock args are
+  // at least 64 bytes long.
+  if (args_bytes_seg.size == 32) {
+    return validate_state_lock(args_bytes_seg.ptr);
+  }
+#endif /* POA_WITH_STATE_LOCK */
+
+  // Script args contain the type ID of PoA setup cell, followed by type IDs
+  // of one or more PoA data cells. All the PoA data cells share the same
+  // setup, and are advanced together by one transaction.
+  if (args_bytes_seg.size < 64 || args_bytes_seg.size % 32 != 0 ||
+      args_bytes_seg.size / 32 - 1 > POA_MAX_DATA_CELLS) {
+    DEBUG("Invalid script args!");
+    return ERROR_ENCODING;
+  }
+  size_t data_cell_count = args_bytes_seg.size / 32 - 1;
+
+  // Each PoA data cell can pair with at most one cell using current lock.
+  len = 0;
+  ret = ckb_load_cell(NULL, &len, 0, data_cell_count, CKB_SOURCE_GROUP_INPUT);
+  if (ret != CKB_INDEX_OUT_OF_BOUND) {
+    DEBUG("Transaction has too many input cells using current lock!");
+    return ERROR_TRANSACTION;
+  }
+  len = 0;
+  ret = ckb_load_cell(NULL, &len, 0, data_cell_count, CKB_SOURCE_GROUP_OUTPUT);
+  if (ret != CKB_INDEX_OUT_OF_BOUND) {
+    DEBUG("Transaction has too many output cells using current lock!");
+    return ERROR_TRANSACTION;
+  }
+
+  init_input_arena(&input_arena);
+
+  uint8_t setup_type_hash[32];
+  calculate_type_id_script_hash(args_bytes_seg.ptr, setup_type_hash);
+
+  PoAWitness witness;
+  ret = load_poa_witness(witness_buffer, SIGNATURE_WITNESS_BUFFER_SIZE,
+                         &witness);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
-  if (output_poa_setup_len > POA_BUFFER_SIZE) {
-    DEBUG("Output PoA cell is too large!");
+  const uint8_t *normal_hints = witness.entries[POA_WITNESS_TAG_NORMAL_HINTS];
+  const uint8_t *consensus_hints =
+      witness.entries[POA_WITNESS_TAG_CONSENSUS_HINTS];
+  const uint8_t *batch = witness.entries[POA_WITNESS_TAG_BATCH];
+
+  size_t dep_poa_setup_cell_index = SIZE_MAX;
+  if (normal_hints != NULL) {
+    if (witness.entry_lengths[POA_WITNESS_TAG_NORMAL_HINTS] !=
+        4 + 8 * data_cell_count) {
+      DEBUG("Invalid normal mode hints!");
+      return ERROR_ENCODING;
+    }
+    dep_poa_setup_cell_index = read_uint32(normal_hints);
+    ret = check_poa_cell(&input_arena, setup_type_hash, CKB_SOURCE_CELL_DEP,
+                         dep_poa_setup_cell_index);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+  } else if (consensus_hints != NULL) {
+    ret = CKB_INDEX_OUT_OF_BOUND;
+  } else {
+    ret = locate_poa_setup_cell_dep(setup_type_hash,
+                                    &dep_poa_setup_cell_index);
+    if (ret != CKB_INDEX_OUT_OF_BOUND && ret != CKB_SUCCESS) {
+      return ret;
+    }
+  }
+  if (ret == CKB_SUCCESS) {
+    if (witness.entries[POA_WITNESS_TAG_MULTISIG] != NULL) {
+      DEBUG("Aggregator approvals can only be used in consensus mode!");
+      return ERROR_ENCODING;
+    }
+    // Normal new blocks. Only the setup header, and later the identity of
+    // current aggregator are loaded, the reported length of the whole cell
+    // data is still validated against the header.
+    PoASetup poa_setup;
+    ret = load_poa_setup(dep_poa_setup_cell_index, CKB_SOURCE_CELL_DEP,
+                         &poa_setup);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+
+    // Since is used to ensure aggregators wait till the correct time.
+    uint64_t since = 0;
+    ret = load_group_since(&since);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    ret = check_poa_since(&poa_setup, &since);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    if (poa_setup.header_time) {
+      ret = load_header_subtime(&poa_setup, &witness, &since);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+    }
+
+    // With signature identities, the signer is recovered once here, and
+    // identities of all aggregators are checked against it.
+    uint8_t signer[32];
+    if (poa_setup.signature_identities) {
+      const uint8_t *signature = witness.entries[POA_WITNESS_TAG_SIGNATURE];
+      if (signature == NULL) {
+        DEBUG("Missing aggregator signature!");
+        return ERROR_ENCODING;
+      }
+      SignatureVerifier verifier;
+      ret = load_signature_verifier(&poa_setup, dep_poa_setup_cell_index,
+                                    CKB_SOURCE_CELL_DEP, &witness, &verifier);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      ret = recover_signer(&verifier, signature,
+                           SETUP_IDENTITY_SIZE(&poa_setup), signer);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+    }
+
+    // The setup and inputs are shared by all PoA data cells, so an identity
+    // is only checked once even when it issues subblocks for several cells.
+    size_t signed_aggregator_index = SIZE_MAX;
+    // With lanes, each lane advances its own PoA data cell independently, so
+    // a transaction only needs to include the PoA data cells of lanes it
+    // advances. Hints use UINT32_MAX for PoA data cells not included.
+    size_t advanced_data_cells = 0;
+    for (size_t i = 0; i < data_cell_count; i++) {
+      uint8_t data_type_hash[32];
+      calculate_type_id_script_hash(&args_bytes_seg.ptr[32 + i * 32],
+                                    data_type_hash);
+
+      size_t input_poa_data_cell_index = SIZE_MAX;
+      if (normal_hints != NULL) {
+        input_poa_data_cell_index = read_uint32(&normal_hints[4 + i * 8]);
+        if (poa_setup.lane_count > 1 &&
+            input_poa_data_cell_index == UINT32_MAX) {
+          continue;
+        }
+        ret = check_poa_cell(&input_arena, data_type_hash, CKB_SOURCE_INPUT,
+                             input_poa_data_cell_index);
+      } else {
+        ret = locate_poa_cell(&input_arena, data_type_hash, CKB_SOURCE_INPUT,
+                              POA_CANONICAL_DATA_CELL_INDEX + i,
+                              &input_poa_data_cell_index);
+        if (poa_setup.lane_count > 1 && ret == CKB_INDEX_OUT_OF_BOUND) {
+          continue;
+        }
+      }
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      advanced_data_cells++;
+      size_t output_poa_data_cell_index = SIZE_MAX;
+      if (normal_hints != NULL) {
+        output_poa_data_cell_index = read_uint32(&normal_hints[8 + i * 8]);
+        ret = check_poa_cell(&input_arena, data_type_hash, CKB_SOURCE_OUTPUT,
+                             output_poa_data_cell_index);
+      } else {
+        ret = locate_poa_cell(&input_arena, data_type_hash, CKB_SOURCE_OUTPUT,
+                              POA_CANONICAL_DATA_CELL_INDEX + i,
+                              &output_poa_data_cell_index);
+      }
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+
+      uint16_t aggregator_index = 0;
+      ret = validate_subblock(&poa_setup, input_poa_data_cell_index,
+                              output_poa_data_cell_index, since, batch,
+                              witness.entry_lengths[POA_WITNESS_TAG_BATCH],
+                              &aggregator_index);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      if (aggregator_index == signed_aggregator_index) {
+        continue;
+      }
+
+      uint8_t identity[IDENTITY_SIZE];
+      ret = load_aggregator_identity(&poa_setup, dep_poa_setup_cell_index,
+                                     CKB_SOURCE_CELL_DEP, &witness,
+                                     aggregator_index, identity);
+      if (ret != CKB_SUCCESS) {
+        return ret;
+      }
+      if (poa_setup.signature_identities) {
+        if (!hash_prefix_equal(signer, identity,
+                               SETUP_IDENTITY_SIZE(&poa_setup))) {
+          DEBUG("Signer is not current aggregator!");
+          return ERROR_ENCODING;
+        }
+      } else {
+        ret = validate_single_signing(&input_arena, identity,
+                                      SETUP_IDENTITY_SIZE(&poa_setup));
+        if (ret != CKB_SUCCESS) {
+          return ret;
+        }
+      }
+      signed_aggregator_index = aggregator_index;
+    }
+    if (advanced_data_cells == 0) {
+      DEBUG("PoA data cell is missing!");
+      return ERROR_ENCODING;
+    }
+    return CKB_SUCCESS;
+  }
+  // PoA consensus mode
+  if (batch != NULL) {
+    DEBUG("Subblock batch can only be used in normal mode!");
     return ERROR_ENCODING;
   }
+  size_t input_poa_setup_cell_index = SIZE_MAX;
+  if (consensus_hints != NULL) {
+    input_poa_setup_cell_index = read_uint32(consensus_hints);
+    ret = check_poa_cell(&input_arena, setup_type_hash, CKB_SOURCE_INPUT,
+                         input_poa_setup_cell_index);
+  } else {
+    ret = look_for_poa_cell(&input_arena, setup_type_hash, CKB_SOURCE_INPUT,
+                            &input_poa_setup_cell_index);
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  // Only setup headers are loaded here, identities of the old setup are
+  // streamed later when matching input lock hashes. The new setup is
+  // validated from its header and length, and its identities are only
+  // streamed to check their order, so that an old setup can rely on it.
+  PoASetup poa_setup;
+  ret = load_poa_setup(input_poa_setup_cell_index, CKB_SOURCE_INPUT,
+                       &poa_setup);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+
+  size_t output_poa_setup_cell_index = SIZE_MAX;
+  if (consensus_hints != NULL) {
+    output_poa_setup_cell_index = read_uint32(&consensus_hints[4]);
+    ret = check_poa_cell(&input_arena, setup_type_hash, CKB_SOURCE_OUTPUT,
+                         output_poa_setup_cell_index);
+  } else {
+    ret = look_for_poa_cell(&input_arena, setup_type_hash, CKB_SOURCE_OUTPUT,
+                            &output_poa_setup_cell_index);
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
   PoASetup new_poa_setup;
-  ret = parse_poa_setup(output_poa_setup_buffer, output_poa_setup_len,
-                        &new_poa_setup);
+  ret = load_poa_setup(output_poa_setup_cell_index, CKB_SOURCE_OUTPUT,
+                       &new_poa_setup);
   if (ret != CKB_SUCCESS) {
     return ret;
   }
+  if (new_poa_setup.identities_sorted) {
+    ret = check_setup_identities_sorted(&new_poa_setup,
+                                        output_poa_setup_cell_index,
+                                        CKB_SOURCE_OUTPUT);
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+  }
 
-  return validate_consensus_signing(
-      poa_setup.identities, poa_setup.identity_size,
-      poa_setup.aggregator_number, poa_setup.aggregator_change_threshold);
+  if (SETUP_MERKLE_IDENTITIES(&poa_setup)) {
+    return validate_consensus_merkle(&input_arena, &poa_setup,
+                                     input_poa_setup_cell_index,
+                                     CKB_SOURCE_INPUT, &witness);
+  }
+  if (poa_setup.signature_identities) {
+    return validate_consensus_multisig(&poa_setup, input_poa_setup_cell_index,
+                                       CKB_SOURCE_INPUT, &witness);
+  }
+  return validate_consensus_signing(&input_arena, &poa_setup,
+                                    input_poa_setup_cell_index,
+                                    CKB_SOURCE_INPUT);
 }
+#endif /* POA_DUAL_LIBRARY */
@@ -0,0 +1,111 @@
+// # PoA Dual Caller
+//
+// Lock script used in tests to exercise the dual build of the PoA lock
+// (build/$(ENVIRONMENT)/poa_dual) the way a layer 2 script would: it loads
+// PoA setup and PoA data cells by itself, then validates the subblock via
+// validate_poa_subblock loaded with ckb_dlopen.
+//
+// Script args contain the data hash of the dual build. The PoA setup cell is
+// cell dep 0, PoA data cells are input 1 and output 1, and the since value of
+// the first input in current script group is used.
+#include "blockchain.h"
+#include "ckb_dlfcn.h"
+#include "ckb_syscalls.h"
+
+#define SCRIPT_BUFFER_SIZE 128
+#define SETUP_BUFFER_SIZE 32768
+#define CODE_SIZE (128 * 1024)
+
+#ifdef ENABLE_DEBUG_MODE
+#define DEBUG(s) ckb_debug(s)
+#else
+#define DEBUG(s)
+#endif /* ENABLE_DEBUG_MODE */
+
+#define ERROR_ENCODING -2
+#define ERROR_DYNAMIC_LOADING -3
+
+typedef int (*ValidatePoASubblockFn)(
+    const uint8_t *setup_data, size_t setup_length, const uint8_t *input_data,
+    size_t input_data_length, const uint8_t *output_data,
+    size_t output_data_length, uint64_t since, const uint8_t *batch,
+    size_t batch_length);
+
+static uint8_t code_buffer[CODE_SIZE] __attribute__((aligned(RISCV_PGSIZE)));
+static uint8_t setup_buffer[SETUP_BUFFER_SIZE];
+
+int main() {
+  uint8_t script[SCRIPT_BUFFER_SIZE];
+  uint64_t len = SCRIPT_BUFFER_SIZE;
+  int ret = ckb_checked_load_script(script, &len, 0);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  mol_seg_t script_seg;
+  script_seg.ptr = (uint8_t *)script;
+  script_seg.size = len;
+  if (MolReader_Script_verify(&script_seg, false) != MOL_OK) {
+    DEBUG("molecule verification failure!");
+    return ERROR_ENCODING;
+  }
+  mol_seg_t args_seg = MolReader_Script_get_args(&script_seg);
+  mol_seg_t args_bytes_seg = MolReader_Bytes_raw_bytes(&args_seg);
+  if (args_bytes_seg.size != 32) {
+    DEBUG("Invalid script args!");
+    return ERROR_ENCODING;
+  }
+
+  void *handle = NULL;
+  size_t consumed_size = 0;
+  ret = ckb_dlopen(args_bytes_seg.ptr, code_buffer, CODE_SIZE, &handle,
+                   &consumed_size);
+  if (ret != CKB_SUCCESS) {
+    DEBUG("Error loading PoA dual build!");
+    return ERROR_DYNAMIC_LOADING;
+  }
+  ValidatePoASubblockFn validate_poa_subblock =
+      (ValidatePoASubblockFn)ckb_dlsym(handle, "validate_poa_subblock");
+  if (validate_poa_subblock == NULL) {
+    DEBUG("Error loading validate_poa_subblock!");
+    return ERROR_DYNAMIC_LOADING;
+  }
+
+  uint64_t setup_length = SETUP_BUFFER_SIZE;
+  ret = ckb_load_cell_data(setup_buffer, &setup_length, 0, 0,
+                           CKB_SOURCE_CELL_DEP);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (setup_length > SETUP_BUFFER_SIZE) {
+    DEBUG("PoA setup is too large!");
+    return ERROR_ENCODING;
+  }
+  uint8_t input_data[22];
+  uint64_t input_data_length = 22;
+  ret = ckb_load_cell_data(input_data, &input_data_length, 0, 1,
+                           CKB_SOURCE_INPUT);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint8_t output_data[22];
+  uint64_t output_data_length = 22;
+  ret = ckb_load_cell_data(output_data, &output_data_length, 0, 1,
+                           CKB_SOURCE_OUTPUT);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint64_t since = 0;
+  len = 8;
+  ret = ckb_load_input_by_field(((uint8_t *)&since), &len, 0, 0,
+                                CKB_SOURCE_GROUP_INPUT, CKB_INPUT_FIELD_SINCE);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  if (len != 8) {
+    DEBUG("Invalid loading since!");
+    return ERROR_ENCODING;
+  }
+  return validate_poa_subblock(setup_buffer, setup_length, input_data,
+                               input_data_length, output_data,
+                               output_data_length, since, NULL, 0);
+}
@@ -29,6 +29,8 @@
 
 #define ERROR_TRANSACTION -1
 
+#include "state_lock.h"
+
 int main() {
   // Load current script so as to extract PoA cell information
   uint8_t script[SCRIPT_BUFFER_SIZE];
@@ -52,24 +54,5 @@ int main() {
     return ERROR_TRANSACTION;
   }
 
-  size_t current = 0;
-  while (current < SIZE_MAX) {
-    uint8_t hash[32];
-    len = 32;
-
-    ret = ckb_load_cell_by_field(hash, &len, 0, current, CKB_SOURCE_INPUT,
-                                 CKB_CELL_FIELD_LOCK_HASH);
-    if (ret != CKB_SUCCESS) {
-      return ret;
-    }
-    if (len != 32) {
-      DEBUG("Invalid script length!");
-      return ERROR_TRANSACTION;
-    }
-    if (memcmp(hash, args_bytes_seg.ptr, 32) == 0) {
-      break;
-    }
-    current++;
-  }
-  return 0;
+  return validate_state_lock(args_bytes_seg.ptr);
 }
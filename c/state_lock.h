@@ -0,0 +1,111 @@
+#ifndef CLERKB_STATE_LOCK_H_
+#define CLERKB_STATE_LOCK_H_
+
+// Validation logic of the state lock, shared by state.c and the combined build
+// of poa.c. Includers provide DEBUG and ERROR_TRANSACTION.
+#include "blockchain.h"
+#include "ckb_syscalls.h"
+#include "hash_compare.h"
+
+// WitnessArgs header: total size, then offsets of lock, input_type and
+// output_type, each a little endian uint32_t.
+#define STATE_WITNESS_HEADER_SIZE 16
+// A hint in the lock field: 4 byte length of Bytes, then the index.
+#define STATE_LOCK_HINT_SIZE 8
+
+// Loads the optional hint from the lock field of WitnessArgs in the first
+// witness of current script group: index of the PoA cell in inputs, as a
+// little endian uint32_t. CKB_ITEM_MISSING is returned when there is no hint,
+// that is a missing or empty witness, a witness that is not a WitnessArgs, or
+// a WitnessArgs without lock field. Only the lock field is loaded, so other
+// scripts can keep payloads of any size in input_type or output_type, while a
+// lock field that is not a 4 byte hint is always rejected.
+int load_state_lock_hint(size_t *index) {
+  uint8_t header[STATE_WITNESS_HEADER_SIZE];
+  uint64_t len = STATE_WITNESS_HEADER_SIZE;
+  int ret = ckb_load_witness(header, &len, 0, 0, CKB_SOURCE_GROUP_INPUT);
+  if (ret == CKB_INDEX_OUT_OF_BOUND) {
+    return CKB_ITEM_MISSING;
+  }
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint64_t witness_length = len;
+  if (witness_length < STATE_WITNESS_HEADER_SIZE) {
+    return CKB_ITEM_MISSING;
+  }
+  uint32_t total_size, lock_start, lock_end;
+  memcpy(&total_size, header, 4);
+  memcpy(&lock_start, &header[4], 4);
+  memcpy(&lock_end, &header[8], 4);
+  if (total_size != witness_length || lock_start != STATE_WITNESS_HEADER_SIZE ||
+      lock_end < lock_start || lock_end > witness_length) {
+    // Not a WitnessArgs
+    return CKB_ITEM_MISSING;
+  }
+  if (lock_end == lock_start) {
+    return CKB_ITEM_MISSING;
+  }
+  if (lock_end - lock_start != STATE_LOCK_HINT_SIZE) {
+    DEBUG("Invalid state lock hint!");
+    return ERROR_TRANSACTION;
+  }
+  uint8_t hint[STATE_LOCK_HINT_SIZE];
+  len = STATE_LOCK_HINT_SIZE;
+  ret = ckb_load_witness(hint, &len, lock_start, 0, CKB_SOURCE_GROUP_INPUT);
+  if (ret != CKB_SUCCESS) {
+    return ret;
+  }
+  uint32_t hint_length, value;
+  memcpy(&hint_length, hint, 4);
+  memcpy(&value, &hint[4], 4);
+  // len is the remaining length from lock_start, which covers the hint as
+  // validated above.
+  if (len < STATE_LOCK_HINT_SIZE || hint_length != 4) {
+    DEBUG("Invalid state lock hint!");
+    return ERROR_TRANSACTION;
+  }
+  *index = value;
+  return CKB_SUCCESS;
+}
+
+// Succeeds when current transaction has an input cell whose lock hash is
+// poa_lock_hash. With a hint, only the hinted input is checked.
+int validate_state_lock(const uint8_t *poa_lock_hash) {
+  size_t hinted_index = SIZE_MAX;
+  int ret = load_state_lock_hint(&hinted_index);
+  if (ret != CKB_SUCCESS && ret != CKB_ITEM_MISSING) {
+    return ret;
+  }
+  int hinted = ret == CKB_SUCCESS;
+  size_t current = hinted ? hinted_index : 0;
+  while (current < SIZE_MAX) {
+    uint8_t hash[32] __attribute__((aligned(8)));
+    uint64_t len = 32;
+
+    ret = ckb_load_cell_by_field(hash, &len, 0, current, CKB_SOURCE_INPUT,
+                                 CKB_CELL_FIELD_LOCK_HASH);
+    if (ret == CKB_INDEX_OUT_OF_BOUND) {
+      DEBUG("PoA cell is missing in inputs!");
+      return ERROR_TRANSACTION;
+    }
+    if (ret != CKB_SUCCESS) {
+      return ret;
+    }
+    if (len != 32) {
+      DEBUG("Invalid script length!");
+      return ERROR_TRANSACTION;
+    }
+    if (hash_equal(hash, poa_lock_hash)) {
+      break;
+    }
+    if (hinted) {
+      DEBUG("Invalid state lock hint!");
+      return ERROR_TRANSACTION;
+    }
+    current++;
+  }
+  return 0;
+}
+
+#endif /* CLERKB_STATE_LOCK_H_ */
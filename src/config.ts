@@ -1,4 +1,4 @@
-import { HexString } from "@ckb-lumos/base";
+import { utils, Hash, HexString } from "@ckb-lumos/base";
 import Ajv from "ajv";
 import { Reader } from "ckb-js-toolkit";
 import { readFileSync } from "fs";
@@ -7,10 +7,28 @@ import schema from "./config_schema.json";
 export interface PoASetup {
   identity_size: number;
   round_interval_uses_seconds: boolean;
+  identities_sorted?: boolean;
+  // Only a Merkle root of identities is kept in PoA setup cell, aggregators
+  // prove their identities with Merkle proofs in PoA witness.
+  merkle_identities?: boolean;
+  // A round using up subblocks_per_round is closed, so the next aggregator
+  // can start its round right away.
+  early_handoff?: boolean;
+  // Aggregators are split into lanes by aggregator index modulo lane_count,
+  // each lane advances its own PoA data cell in parallel.
+  lane_count?: number;
+  // The next aggregator can open its round overlap_window before current
+  // round ends, the outgoing aggregator can then commit only one more
+  // subblock.
+  overlap_window?: number;
+  // Subtime comes from the timestamp of a header dep instead of since, which
+  // can trail the header timestamp by at most max_header_age seconds.
+  max_header_age?: number;
   identities: Array<HexString>;
   aggregator_change_threshold: number;
   round_intervals: number;
   subblocks_per_round: number;
+  signature_code_hash?: Hash;
 }
 
 export interface PoAData {
@@ -44,10 +62,15 @@ export function validateConfig(config: Config): Config {
   if (config.poa_setup.identities.length === 0) {
     throw new Error("No identity is setup!");
   }
-  // Additional check: there can at most be 255 aggregators
-  if (config.poa_setup.identities.length > 255) {
+  // Additional check: there can at most be 255 aggregators, or 65535
+  // aggregators with Merkle identities
+  const maxAggregators = config.poa_setup.merkle_identities ? 65535 : 255;
+  if (config.poa_setup.identities.length > maxAggregators) {
     throw new Error("Too many aggregators!");
   }
+  if (config.poa_setup.merkle_identities && config.poa_setup.identities_sorted) {
+    throw new Error("Merkle identities cannot be sorted!");
+  }
   // Additional check: all identities must be of the same length
   const firstLength = config.poa_setup.identities[0].length;
   for (let i = 1; i < config.poa_setup.identities.length; i++) {
@@ -55,6 +78,17 @@ export function validateConfig(config: Config): Config {
       throw new Error("Identity lengths must all be the same!");
     }
   }
+  // Additional check: sorted identities must be unique and in ascending order
+  if (config.poa_setup.identities_sorted) {
+    for (let i = 1; i < config.poa_setup.identities.length; i++) {
+      if (
+        config.poa_setup.identities[i - 1].toLowerCase() >=
+        config.poa_setup.identities[i].toLowerCase()
+      ) {
+        throw new Error("Identities must be sorted in ascending order!");
+      }
+    }
+  }
   // Additional check: change threshold must not be larger than identity size
   if (
     config.poa_setup.aggregator_change_threshold >
@@ -62,6 +96,44 @@ export function validateConfig(config: Config): Config {
   ) {
     throw new Error("Invalid change threshold!");
   }
+  // Additional check: with Merkle identities, proofs and signatures approving
+  // a setup update must fit in the 32768 byte PoA witness buffer of the lock
+  if (config.poa_setup.merkle_identities) {
+    const identitySize = (firstLength - 2) / 2;
+    let depth = 0;
+    while (1 << depth < config.poa_setup.identities.length) {
+      depth++;
+    }
+    const threshold = config.poa_setup.aggregator_change_threshold;
+    let witnessSize =
+      4 + (3 + 8) + 3 + threshold * (2 + identitySize + 32 * depth);
+    if (config.poa_setup.signature_code_hash) {
+      witnessSize += 3 + threshold * 65;
+    }
+    if (witnessSize > 32768) {
+      throw new Error("Change threshold does not fit in PoA witness!");
+    }
+  }
+  // Additional check: each lane must have at least one aggregator
+  if (
+    config.poa_setup.lane_count !== undefined &&
+    config.poa_setup.lane_count > config.poa_setup.identities.length
+  ) {
+    throw new Error("Invalid lane count!");
+  }
+  // Additional check: overlap window must be shorter than a round
+  if (
+    config.poa_setup.overlap_window !== undefined &&
+    config.poa_setup.overlap_window >= config.poa_setup.round_intervals
+  ) {
+    throw new Error("Invalid overlap window!");
+  }
+  if (
+    config.poa_setup.max_header_age !== undefined &&
+    !config.poa_setup.round_interval_uses_seconds
+  ) {
+    throw new Error("Header time requires round intervals in seconds!");
+  }
   return config;
 }
 
@@ -71,9 +143,20 @@ export function parsePoASetup(buffer: ArrayBuffer): PoASetup {
   }
   const bufferArray = new Uint8Array(buffer);
   const view = new DataView(buffer);
+  const flags = view.getUint8(0);
+  if ((flags & 8) === 8) {
+    // Identities are not available on chain, they must come from config.
+    throw new Error("PoA setup with Merkle identities cannot be parsed!");
+  }
   const identitySize = view.getUint8(1);
   const aggregatorNumber = view.getUint8(2);
-  if (buffer.byteLength !== 12 + identitySize * aggregatorNumber) {
+  const extensionOffset = 12 + identitySize * aggregatorNumber;
+  const tailOffset = extensionOffset + ((flags & 4) === 4 ? 32 : 0);
+  const tailLength =
+    ((flags & 32) === 32 ? 1 : 0) +
+    ((flags & 64) === 64 ? 4 : 0) +
+    ((flags & 128) === 128 ? 4 : 0);
+  if (buffer.byteLength !== tailOffset + tailLength) {
     throw new Error("Invalid length!");
   }
   const identities = [];
@@ -85,24 +168,142 @@ export function parsePoASetup(buffer: ArrayBuffer): PoASetup {
     identities.push(new Reader(identityBuffer).serializeJson());
   }
   const setup: PoASetup = {
-    round_interval_uses_seconds: (view.getUint8(0) & 1) === 1,
+    round_interval_uses_seconds: (flags & 1) === 1,
+    identities_sorted: (flags & 2) === 2,
+    early_handoff: (flags & 16) === 16,
     aggregator_change_threshold: view.getUint8(3),
     round_intervals: view.getUint32(4, true),
     subblocks_per_round: view.getUint32(8, true),
     identity_size: identitySize,
     identities: identities,
   };
+  if ((flags & 4) === 4) {
+    setup.signature_code_hash = new Reader(
+      buffer.slice(extensionOffset, extensionOffset + 32)
+    ).serializeJson();
+  }
+  let offset = tailOffset;
+  if ((flags & 32) === 32) {
+    setup.lane_count = view.getUint8(offset);
+    offset += 1;
+  }
+  if ((flags & 64) === 64) {
+    setup.overlap_window = view.getUint32(offset, true);
+    offset += 4;
+  }
+  if ((flags & 128) === 128) {
+    setup.max_header_age = view.getUint32(offset, true);
+  }
   return validateConfig({ poa_setup: setup }).poa_setup;
 }
 
+function hashMerkleNode(prefix: number, parts: Array<HexString>): Hash {
+  const hasher = new utils.CKBHasher();
+  hasher.update(new Uint8Array([prefix]).buffer);
+  for (const part of parts) {
+    hasher.update(part);
+  }
+  return hasher.digestHex();
+}
+
+// Levels of the identity Merkle tree from leaves to root. A leaf is
+// blake2b(0x00 || identity), a parent node is blake2b(0x01 || left || right),
+// missing leaves are filled with 32 zero bytes.
+function buildIdentitiesMerkleTree(poaSetup: PoASetup): Array<Array<Hash>> {
+  let level = poaSetup.identities.map((identity) =>
+    hashMerkleNode(0, [identity])
+  );
+  while ((level.length & (level.length - 1)) !== 0) {
+    level.push("0x" + "00".repeat(32));
+  }
+  const levels = [level];
+  while (level.length > 1) {
+    const parents = [];
+    for (let i = 0; i < level.length; i += 2) {
+      parents.push(hashMerkleNode(1, [level[i], level[i + 1]]));
+    }
+    levels.push(parents);
+    level = parents;
+  }
+  return levels;
+}
+
+export function calculateIdentitiesMerkleRoot(poaSetup: PoASetup): Hash {
+  const levels = buildIdentitiesMerkleTree(poaSetup);
+  return levels[levels.length - 1][0];
+}
+
+// Merkle proof of an aggregator's identity: u16 aggregator index, identity,
+// then sibling hashes from leaf to root.
+export function buildIdentityMerkleProof(
+  poaSetup: PoASetup,
+  aggregatorIndex: number
+): HexString {
+  const levels = buildIdentitiesMerkleTree(poaSetup);
+  const indexBuffer = new ArrayBuffer(2);
+  new DataView(indexBuffer).setUint16(0, aggregatorIndex, true);
+  let proof = new Reader(indexBuffer).serializeJson();
+  proof += poaSetup.identities[aggregatorIndex].slice(2);
+  let current = aggregatorIndex;
+  for (let i = 0; i < levels.length - 1; i++) {
+    proof += levels[i][current ^ 1].slice(2);
+    current >>= 1;
+  }
+  return proof;
+}
+
+// Flags of extension fields following identities, or the Merkle root.
+function poaSetupTailFlags(poaSetup: PoASetup): number {
+  return (
+    (poaSetup.lane_count !== undefined ? 32 : 0) |
+    (poaSetup.overlap_window !== undefined ? 64 : 0) |
+    (poaSetup.max_header_age !== undefined ? 128 : 0)
+  );
+}
+
+// Extension fields following identities, or the Merkle root.
+function serializePoASetupTail(poaSetup: PoASetup): Uint8Array {
+  const tail = new Uint8Array(
+    (poaSetup.lane_count !== undefined ? 1 : 0) +
+      (poaSetup.overlap_window !== undefined ? 4 : 0) +
+      (poaSetup.max_header_age !== undefined ? 4 : 0)
+  );
+  const view = new DataView(tail.buffer);
+  let offset = 0;
+  if (poaSetup.lane_count !== undefined) {
+    view.setUint8(offset, poaSetup.lane_count);
+    offset += 1;
+  }
+  if (poaSetup.overlap_window !== undefined) {
+    view.setUint32(offset, poaSetup.overlap_window, true);
+    offset += 4;
+  }
+  if (poaSetup.max_header_age !== undefined) {
+    view.setUint32(offset, poaSetup.max_header_age, true);
+  }
+  return tail;
+}
+
 export function serializePoASetup(poaSetup: PoASetup): ArrayBuffer {
-  const length =
+  if (poaSetup.merkle_identities) {
+    return serializeMerklePoASetup(poaSetup);
+  }
+  const extensionOffset =
     12 +
     poaSetup.identities.length * new Reader(poaSetup.identities[0]).length();
-  const buffer = new ArrayBuffer(length);
+  const tailOffset = extensionOffset + (poaSetup.signature_code_hash ? 32 : 0);
+  const tail = serializePoASetupTail(poaSetup);
+  const buffer = new ArrayBuffer(tailOffset + tail.length);
   const view = new DataView(buffer);
   const uint8array = new Uint8Array(buffer);
-  view.setUint8(0, poaSetup.round_interval_uses_seconds ? 1 : 0);
+  view.setUint8(
+    0,
+    (poaSetup.round_interval_uses_seconds ? 1 : 0) |
+      (poaSetup.identities_sorted ? 2 : 0) |
+      (poaSetup.signature_code_hash ? 4 : 0) |
+      (poaSetup.early_handoff ? 16 : 0) |
+      poaSetupTailFlags(poaSetup)
+  );
   view.setUint8(1, poaSetup.identity_size);
   view.setUint8(2, poaSetup.identities.length);
   view.setUint8(3, poaSetup.aggregator_change_threshold);
@@ -114,6 +315,49 @@ export function serializePoASetup(poaSetup: PoASetup): ArrayBuffer {
       12 + i * poaSetup.identity_size
     );
   }
+  if (poaSetup.signature_code_hash) {
+    uint8array.set(
+      new Uint8Array(new Reader(poaSetup.signature_code_hash).toArrayBuffer()),
+      extensionOffset
+    );
+  }
+  uint8array.set(tail, tailOffset);
+  return buffer;
+}
+
+function serializeMerklePoASetup(poaSetup: PoASetup): ArrayBuffer {
+  const merkleOffset = 12 + (poaSetup.signature_code_hash ? 32 : 0);
+  const tailOffset = merkleOffset + 36;
+  const tail = serializePoASetupTail(poaSetup);
+  const buffer = new ArrayBuffer(tailOffset + tail.length);
+  const view = new DataView(buffer);
+  const uint8array = new Uint8Array(buffer);
+  view.setUint8(
+    0,
+    (poaSetup.round_interval_uses_seconds ? 1 : 0) |
+      (poaSetup.signature_code_hash ? 4 : 0) |
+      8 |
+      (poaSetup.early_handoff ? 16 : 0) |
+      poaSetupTailFlags(poaSetup)
+  );
+  view.setUint8(1, poaSetup.identity_size);
+  view.setUint32(4, poaSetup.round_intervals, true);
+  view.setUint32(8, poaSetup.subblocks_per_round, true);
+  if (poaSetup.signature_code_hash) {
+    uint8array.set(
+      new Uint8Array(new Reader(poaSetup.signature_code_hash).toArrayBuffer()),
+      12
+    );
+  }
+  view.setUint16(merkleOffset, poaSetup.identities.length, true);
+  view.setUint16(merkleOffset + 2, poaSetup.aggregator_change_threshold, true);
+  uint8array.set(
+    new Uint8Array(
+      new Reader(calculateIdentitiesMerkleRoot(poaSetup)).toArrayBuffer()
+    ),
+    merkleOffset + 4
+  );
+  uint8array.set(tail, tailOffset);
   return buffer;
 }
 
@@ -139,3 +383,266 @@ export function serializePoAData(poaData: PoAData): ArrayBuffer {
   view.setUint16(20, poaData.aggregator_index, true);
   return buffer;
 }
+
+// Indices of a PoA data cell in inputs and outputs, both are
+// POA_SKIPPED_DATA_CELL_INDEX when the PoA data cell is skipped with lanes.
+export interface PoADataCellHints {
+  input_index: number;
+  output_index: number;
+}
+
+export const POA_SKIPPED_DATA_CELL_INDEX = 0xffffffff;
+
+export interface PoANormalHints {
+  setup_dep_index: number;
+  // One item for each PoA data cell in PoA lock args, in the same order.
+  data_cells: Array<PoADataCellHints>;
+}
+
+export interface PoAConsensusHints {
+  setup_input_index: number;
+  setup_output_index: number;
+}
+
+// Approvals of a PoA setup update with signature identities.
+export interface PoAMultisig {
+  // One bit per aggregator in little endian bit order, set when the aggregator
+  // approves the update. Exactly aggregator_change_threshold bits are set.
+  signer_bitmap: HexString;
+  // Signatures of approving aggregators, in the order of aggregator indices.
+  signatures: Array<HexString>;
+}
+
+// Content of the lock field in PoA cell's WitnessArgs, all parts are optional.
+export interface PoAWitness {
+  normal_hints?: PoANormalHints;
+  consensus_hints?: PoAConsensusHints;
+  // Subtimes of all subblocks committed in a batch, the last one must match
+  // the subblock in PoA data cell.
+  subblock_subtimes?: Array<bigint>;
+  // Recoverable secp256k1 signature of current aggregator, used with
+  // signature identities.
+  signature?: HexString;
+  multisig?: PoAMultisig;
+  // Merkle proofs of aggregator identities, used with Merkle identities. See
+  // buildIdentityMerkleProof for the format.
+  merkle_proofs?: Array<HexString>;
+  // Index of the header dep providing subtime, used with header time. Header
+  // dep 0 is used when missing.
+  header_dep_index?: number;
+}
+
+export const POA_WITNESS_TAG_NORMAL_HINTS = 1;
+export const POA_WITNESS_TAG_CONSENSUS_HINTS = 2;
+export const POA_WITNESS_TAG_BATCH = 3;
+export const POA_WITNESS_TAG_SIGNATURE = 4;
+export const POA_WITNESS_TAG_MULTISIG = 5;
+export const POA_WITNESS_TAG_MERKLE_PROOFS = 6;
+export const POA_WITNESS_TAG_HEADER_DEP = 7;
+
+function serializeUint32Array(values: Array<number>): ArrayBuffer {
+  const buffer = new ArrayBuffer(values.length * 4);
+  const view = new DataView(buffer);
+  for (let i = 0; i < values.length; i++) {
+    view.setUint32(i * 4, values[i], true);
+  }
+  return buffer;
+}
+
+export function serializePoAWitness(poaWitness: PoAWitness): ArrayBuffer {
+  const entries: Array<[number, ArrayBuffer]> = [];
+  if (poaWitness.normal_hints) {
+    entries.push([
+      POA_WITNESS_TAG_NORMAL_HINTS,
+      serializeUint32Array(
+        poaWitness.normal_hints.data_cells.reduce(
+          (values: Array<number>, hints) =>
+            values.concat([hints.input_index, hints.output_index]),
+          [poaWitness.normal_hints.setup_dep_index]
+        )
+      ),
+    ]);
+  }
+  if (poaWitness.consensus_hints) {
+    entries.push([
+      POA_WITNESS_TAG_CONSENSUS_HINTS,
+      serializeUint32Array([
+        poaWitness.consensus_hints.setup_input_index,
+        poaWitness.consensus_hints.setup_output_index,
+      ]),
+    ]);
+  }
+  if (poaWitness.subblock_subtimes) {
+    const buffer = new ArrayBuffer(poaWitness.subblock_subtimes.length * 8);
+    const view = new DataView(buffer);
+    poaWitness.subblock_subtimes.forEach((subtime, i) =>
+      view.setBigUint64(i * 8, subtime, true)
+    );
+    entries.push([POA_WITNESS_TAG_BATCH, buffer]);
+  }
+  if (poaWitness.signature) {
+    entries.push([
+      POA_WITNESS_TAG_SIGNATURE,
+      new Reader(poaWitness.signature).toArrayBuffer(),
+    ]);
+  }
+  if (poaWitness.multisig) {
+    const parts = [poaWitness.multisig.signer_bitmap].concat(
+      poaWitness.multisig.signatures
+    );
+    const payloads = parts.map((part) => new Reader(part).toArrayBuffer());
+    const buffer = new Uint8Array(
+      payloads.reduce((total, payload) => total + payload.byteLength, 0)
+    );
+    let offset = 0;
+    for (const payload of payloads) {
+      buffer.set(new Uint8Array(payload), offset);
+      offset += payload.byteLength;
+    }
+    entries.push([POA_WITNESS_TAG_MULTISIG, buffer.buffer]);
+  }
+  if (poaWitness.merkle_proofs) {
+    entries.push([
+      POA_WITNESS_TAG_MERKLE_PROOFS,
+      new Reader(
+        "0x" + poaWitness.merkle_proofs.map((proof) => proof.slice(2)).join("")
+      ).toArrayBuffer(),
+    ]);
+  }
+  if (poaWitness.header_dep_index !== undefined) {
+    entries.push([
+      POA_WITNESS_TAG_HEADER_DEP,
+      serializeUint32Array([poaWitness.header_dep_index]),
+    ]);
+  }
+  const length = entries.reduce(
+    (total, [_tag, payload]) => total + 3 + payload.byteLength,
+    0
+  );
+  const buffer = new ArrayBuffer(length);
+  const view = new DataView(buffer);
+  const uint8array = new Uint8Array(buffer);
+  let offset = 0;
+  for (const [tag, payload] of entries) {
+    if (payload.byteLength > 0xffff) {
+      throw new Error("PoA witness entry is too large!");
+    }
+    view.setUint8(offset, tag);
+    view.setUint16(offset + 1, payload.byteLength, true);
+    uint8array.set(new Uint8Array(payload), offset + 3);
+    offset += 3 + payload.byteLength;
+  }
+  return buffer;
+}
+
+export function parsePoAWitness(buffer: ArrayBuffer): PoAWitness {
+  const view = new DataView(buffer);
+  const poaWitness: PoAWitness = {};
+  let offset = 0;
+  while (offset < buffer.byteLength) {
+    if (buffer.byteLength - offset < 3) {
+      throw new Error("Invalid PoA witness entry!");
+    }
+    const tag = view.getUint8(offset);
+    const length = view.getUint16(offset + 1, true);
+    offset += 3;
+    if (buffer.byteLength - offset < length) {
+      throw new Error("Invalid PoA witness entry!");
+    }
+    const payload = new DataView(buffer, offset, length);
+    switch (tag) {
+      case POA_WITNESS_TAG_NORMAL_HINTS:
+        if (length < 12 || (length - 4) % 8 !== 0) {
+          throw new Error("Invalid normal mode hints!");
+        }
+        poaWitness.normal_hints = {
+          setup_dep_index: payload.getUint32(0, true),
+          data_cells: [],
+        };
+        for (let i = 4; i < length; i += 8) {
+          poaWitness.normal_hints.data_cells.push({
+            input_index: payload.getUint32(i, true),
+            output_index: payload.getUint32(i + 4, true),
+          });
+        }
+        break;
+      case POA_WITNESS_TAG_CONSENSUS_HINTS:
+        if (length !== 8) {
+          throw new Error("Invalid consensus mode hints!");
+        }
+        poaWitness.consensus_hints = {
+          setup_input_index: payload.getUint32(0, true),
+          setup_output_index: payload.getUint32(4, true),
+        };
+        break;
+      case POA_WITNESS_TAG_BATCH:
+        if (length === 0 || length % 8 !== 0) {
+          throw new Error("Invalid subblock batch!");
+        }
+        poaWitness.subblock_subtimes = [];
+        for (let i = 0; i < length; i += 8) {
+          poaWitness.subblock_subtimes.push(payload.getBigUint64(i, true));
+        }
+        break;
+      case POA_WITNESS_TAG_SIGNATURE:
+        if (length !== 65) {
+          throw new Error("Invalid signature!");
+        }
+        poaWitness.signature = new Reader(
+          buffer.slice(offset, offset + length)
+        ).serializeJson();
+        break;
+      case POA_WITNESS_TAG_MULTISIG: {
+        // Signer bitmap takes at most 32 bytes, so its size can be derived
+        // from payload length without knowing the number of aggregators.
+        const bitmapSize = length % 65;
+        const signatures = [];
+        for (let i = offset + bitmapSize; i < offset + length; i += 65) {
+          signatures.push(new Reader(buffer.slice(i, i + 65)).serializeJson());
+        }
+        poaWitness.multisig = {
+          signer_bitmap: new Reader(
+            buffer.slice(offset, offset + bitmapSize)
+          ).serializeJson(),
+          signatures,
+        };
+        break;
+      }
+      case POA_WITNESS_TAG_MERKLE_PROOFS:
+        // Proof size depends on PoA setup, the payload is kept as a whole.
+        poaWitness.merkle_proofs = [
+          new Reader(buffer.slice(offset, offset + length)).serializeJson(),
+        ];
+        break;
+      case POA_WITNESS_TAG_HEADER_DEP:
+        if (length !== 4) {
+          throw new Error("Invalid header dep index!");
+        }
+        poaWitness.header_dep_index = payload.getUint32(0, true);
+        break;
+      default:
+        throw new Error(`Invalid PoA witness tag: ${tag}`);
+    }
+    offset += length;
+  }
+  return poaWitness;
+}
+
+// Message signed by aggregators with signature identities: blake2b hash of
+// transaction hash, followed by all PoA witness entries other than signatures
+// in tag order. Setup update approvals sign the same message.
+export function calculateSigningMessage(
+  txHash: Hash,
+  poaWitness: PoAWitness
+): Hash {
+  const hasher = new utils.CKBHasher();
+  hasher.update(txHash);
+  hasher.update(
+    serializePoAWitness({
+      ...poaWitness,
+      signature: undefined,
+      multisig: undefined,
+    })
+  );
+  return hasher.digestHex();
+}
@@ -1,4 +1,4 @@
-import { Reader } from "ckb-js-toolkit";
+import { normalizers, Reader } from "ckb-js-toolkit";
 import {
   core,
   since,
@@ -7,19 +7,32 @@ import {
   CellDep,
   Hash,
   HashType,
+  Header,
   Indexer,
   HexNumber,
   HexString,
+  OutPoint,
   Script,
 } from "@ckb-lumos/base";
 import { common } from "@ckb-lumos/common-scripts";
 import { getConfig, initializeConfig } from "@ckb-lumos/config-manager";
-import { TransactionSkeletonType, addressToScript } from "@ckb-lumos/helpers";
+import {
+  TransactionSkeletonType,
+  addressToScript,
+  createTransactionFromSkeleton,
+} from "@ckb-lumos/helpers";
 import {
   PoAData,
+  PoASetup,
+  calculateSigningMessage,
   parsePoAData,
   parsePoASetup,
+  parsePoAWitness,
   serializePoAData,
+  serializePoAWitness,
+  PoADataCellHints,
+  PoAWitness,
+  POA_SKIPPED_DATA_CELL_INDEX,
 } from "./config";
 
 type State = "Yes" | "YesIfFull" | "No";
@@ -39,6 +52,138 @@ function pushAndFix(
   });
 }
 
+function isSameOutPoint(a: OutPoint, b: OutPoint) {
+  return a.tx_hash === b.tx_hash && BigInt(a.index) === BigInt(b.index);
+}
+
+function serializePoAWitnessArgs(poaWitness: PoAWitness): HexString {
+  const lock = new Reader(serializePoAWitness(poaWitness)).serializeJson();
+  return new Reader(
+    core.SerializeWitnessArgs(normalizers.NormalizeWitnessArgs({ lock }))
+  ).serializeJson();
+}
+
+function parsePoAWitnessArgs(witness: HexString): PoAWitness {
+  if (witness === "0x") {
+    return {};
+  }
+  const witnessArgs = new core.WitnessArgs(new Reader(witness));
+  if (!witnessArgs.getLock().hasValue()) {
+    return {};
+  }
+  return parsePoAWitness(witnessArgs.getLock().value().raw());
+}
+
+// Witness for state lock, pointing it at the PoA cell in inputs.
+function serializeStateLockHint(poaInputIndex: number): HexString {
+  const buffer = new ArrayBuffer(4);
+  new DataView(buffer).setUint32(0, poaInputIndex, true);
+  const lock = new Reader(buffer).serializeJson();
+  return new Reader(
+    core.SerializeWitnessArgs(normalizers.NormalizeWitnessArgs({ lock }))
+  ).serializeJson();
+}
+
+// Current time used as subtime. With header time, the timestamp of tipHeader
+// is used, which runs ahead of median time. With round intervals in blocks,
+// it is the number of the block following tipHeader, which is the earliest
+// block a new transaction can be committed in.
+function currentSubtime(
+  poaSetup: PoASetup,
+  medianTimeHex: HexNumber,
+  tipHeader?: Header
+): bigint {
+  if (
+    poaSetup.round_interval_uses_seconds &&
+    poaSetup.max_header_age === undefined
+  ) {
+    return BigInt(medianTimeHex) / 1000n;
+  }
+  if (!tipHeader) {
+    throw new Error("PoA setup requires a tip header!");
+  }
+  if (!poaSetup.round_interval_uses_seconds) {
+    return BigInt(tipHeader.number) + 1n;
+  }
+  return BigInt(tipHeader.timestamp) / 1000n;
+}
+
+// Indices of the PoA data cells advanced by current aggregator. With lanes,
+// only PoA data cells of the aggregator's lane are advanced, given by the
+// aggregator index kept in them, otherwise all PoA data cells must advance in
+// every transaction.
+function advancedDataCellIndices(
+  poaSetup: PoASetup,
+  poaDatas: Array<PoAData>,
+  aggregatorIndex: number
+): Array<number> {
+  const laneCount = poaSetup.lane_count || 1;
+  const indices: Array<number> = [];
+  poaDatas.forEach((poaData, i) => {
+    if (poaData.aggregator_index % laneCount === aggregatorIndex % laneCount) {
+      indices.push(i);
+    }
+  });
+  return indices;
+}
+
+// Subtimes of subblockCount new subblocks issued on top of poaData, together
+// with the resulting PoA data. An aggregator other than the one kept in
+// poaData always opens a new round, even before current round ends, as in an
+// overlap window or an early handoff.
+function nextPoAData(
+  poaSetup: PoASetup,
+  poaData: PoAData,
+  aggregatorIndex: number,
+  currentTime: bigint,
+  subblockCount: number
+): { subblockSubtimes: Array<bigint>; newPoAData: PoAData } {
+  const subblockSubtimes: Array<bigint> = [];
+  if (
+    aggregatorIndex === poaData.aggregator_index &&
+    currentTime <
+      poaData.round_initial_subtime + BigInt(poaSetup.round_intervals) &&
+    poaData.subblock_index + subblockCount < poaSetup.subblocks_per_round
+  ) {
+    // New blocks in current round. With header time, subtime must be the
+    // timestamp of the header dep, with round intervals in blocks, since
+    // can be no later than the block committing the transaction.
+    const useCurrentTime =
+      poaSetup.max_header_age !== undefined ||
+      !poaSetup.round_interval_uses_seconds;
+    for (let i = 1; i <= subblockCount; i++) {
+      subblockSubtimes.push(
+        useCurrentTime ? currentTime : poaData.subblock_subtime + BigInt(i)
+      );
+    }
+    return {
+      subblockSubtimes,
+      newPoAData: {
+        round_initial_subtime: poaData.round_initial_subtime,
+        subblock_subtime: subblockSubtimes[subblockCount - 1],
+        subblock_index: poaData.subblock_index + subblockCount,
+        aggregator_index: poaData.aggregator_index,
+      },
+    };
+  }
+  // New blocks in new round
+  if (subblockCount > poaSetup.subblocks_per_round) {
+    throw new Error("Too many subblocks for one round!");
+  }
+  for (let i = 0; i < subblockCount; i++) {
+    subblockSubtimes.push(currentTime);
+  }
+  return {
+    subblockSubtimes,
+    newPoAData: {
+      round_initial_subtime: currentTime,
+      subblock_subtime: currentTime,
+      subblock_index: subblockCount - 1,
+      aggregator_index: aggregatorIndex,
+    },
+  };
+}
+
 initializeConfig();
 
 export class PoAGenerator {
@@ -65,17 +210,26 @@ export class PoAGenerator {
     this.roundStartSubtime = undefined;
   }
 
+  // tipHeader is required when the PoA setup uses header time, or round
+  // intervals in blocks.
   async shouldIssueNewBlock(
     medianTimeHex: HexNumber,
-    tipCell: Cell
+    tipCell: Cell,
+    tipHeader?: Header
   ): Promise<State> {
-    const medianTime = BigInt(medianTimeHex) / 1000n;
-    const { poaData, poaSetup, aggregatorIndex } = await this._queryPoAInfos(
+    const { poaDatas, poaSetup, aggregatorIndex } = await this._queryPoAInfos(
       tipCell
     );
+    const currentTime = currentSubtime(poaSetup, medianTimeHex, tipHeader);
+    // Within the overlap window, the next aggregator may already open its
+    // round, so current aggregator leaves the window to the handoff.
+    const overlapWindow = BigInt(poaSetup.overlap_window || 0);
     if (this.roundStartSubtime) {
       const remaining =
-        this.roundStartSubtime + BigInt(poaSetup.round_intervals) - medianTime;
+        this.roundStartSubtime +
+        BigInt(poaSetup.round_intervals) -
+        overlapWindow -
+        currentTime;
       if (remaining > 0n) {
         this.logger(`Aggregator in round, remaining time: ${remaining}`);
         return "YesIfFull";
@@ -83,23 +237,61 @@ export class PoAGenerator {
         this.roundStartSubtime = undefined;
       }
     }
-    let steps =
-      (aggregatorIndex +
-        poaSetup.identities.length -
-        poaData.aggregator_index) %
-      poaSetup.identities.length;
-    if (steps === 0) {
-      steps = poaSetup.identities.length;
+    // With lanes, a PoA data cell only rotates among aggregators of its lane,
+    // steps are counted within the lane.
+    const laneCount = poaSetup.lane_count || 1;
+    const lane = aggregatorIndex % laneCount;
+    const indices = advancedDataCellIndices(
+      poaSetup,
+      poaDatas,
+      aggregatorIndex
+    );
+    if (indices.length === 0) {
+      this.logger(`No PoA data cell is in lane ${lane} of aggregator`);
+      return "No";
     }
-    const initialTime = poaData.round_initial_subtime;
-    const nextStartTime =
-      initialTime + BigInt(poaSetup.round_intervals) * BigInt(steps);
-    const waitTime = nextStartTime - medianTime;
-    this.logger(
-      `On chain index: ${poaData.aggregator_index}, steps: ${steps}, initial time: ${initialTime}, next start time: ${nextStartTime}, wait time: ${waitTime}`
+    const laneSize = Math.floor(
+      (poaSetup.identities.length - lane + laneCount - 1) / laneCount
     );
-    if (waitTime <= 0n) {
-      this.roundStartSubtime = medianTime;
+    // All advanced PoA data cells must be ready for current aggregator.
+    let waitTime: bigint | undefined = undefined;
+    for (const i of indices) {
+      const poaData = poaDatas[i];
+      let steps =
+        (Math.floor(aggregatorIndex / laneCount) +
+          laneSize -
+          Math.floor(poaData.aggregator_index / laneCount)) %
+        laneSize;
+      if (steps === 0) {
+        steps = laneSize;
+      }
+      const initialTime = poaData.round_initial_subtime;
+      let nextStartTime =
+        initialTime + BigInt(poaSetup.round_intervals) * BigInt(steps);
+      if (steps === 1 && aggregatorIndex !== poaData.aggregator_index) {
+        // The next aggregator can open its round once the overlap window
+        // starts, so the handoff transaction is built ahead of round end.
+        nextStartTime -= overlapWindow;
+        // With early handoff, the next aggregator can start as soon as
+        // current round uses up its subblocks.
+        if (
+          nextStartTime < poaData.subblock_subtime ||
+          (poaSetup.early_handoff &&
+            poaData.subblock_index + 1 >= poaSetup.subblocks_per_round)
+        ) {
+          nextStartTime = poaData.subblock_subtime;
+        }
+      }
+      const cellWaitTime = nextStartTime - currentTime;
+      this.logger(
+        `PoA data cell: ${i}, on chain index: ${poaData.aggregator_index}, steps: ${steps}, initial time: ${initialTime}, next start time: ${nextStartTime}, wait time: ${cellWaitTime}`
+      );
+      if (waitTime === undefined || cellWaitTime > waitTime) {
+        waitTime = cellWaitTime;
+      }
+    }
+    if (waitTime! <= 0n) {
+      this.roundStartSubtime = currentTime;
       return "Yes";
     }
     return "No";
@@ -107,11 +299,32 @@ export class PoAGenerator {
 
   async fixTransactionSkeleton(
     medianTimeHex: HexNumber,
-    txSkeleton: TransactionSkeletonType
+    txSkeleton: TransactionSkeletonType,
+    tipHeader?: Header
   ): Promise<TransactionSkeletonType> {
+    return this.fixBatchTransactionSkeleton(
+      medianTimeHex,
+      txSkeleton,
+      1,
+      tipHeader
+    );
+  }
+
+  // Same as fixTransactionSkeleton, but commits subblockCount subblocks in
+  // one transaction, the subtimes of all of them are kept in the PoA cell's
+  // witness.
+  async fixBatchTransactionSkeleton(
+    medianTimeHex: HexNumber,
+    txSkeleton: TransactionSkeletonType,
+    subblockCount: number,
+    tipHeader?: Header
+  ): Promise<TransactionSkeletonType> {
+    if (!Number.isInteger(subblockCount) || subblockCount < 1) {
+      throw new Error("Subblock count must be a positive integer!");
+    }
     const {
-      poaData,
-      poaDataCell,
+      poaDatas,
+      poaDataCells,
       poaSetup,
       poaSetupCell,
       aggregatorIndex,
@@ -129,54 +342,95 @@ export class PoAGenerator {
         dep_type: "code",
       })
     );
-    txSkeleton = pushAndFix(txSkeleton, poaDataCell, "inputs");
-    // Dummy witness to hold the place for input cell.
-    txSkeleton = txSkeleton.update("witnesses", (witnesses) =>
-      witnesses.push("0x")
+    const indices = advancedDataCellIndices(
+      poaSetup,
+      poaDatas,
+      aggregatorIndex
     );
-    const medianTime = BigInt(medianTimeHex) / 1000n;
-    let newPoAData: PoAData;
-    if (
-      medianTime <
-        poaData.round_initial_subtime + BigInt(poaSetup.round_intervals) &&
-      poaData.subblock_index + 1 < poaSetup.subblocks_per_round
-    ) {
-      // New block in current round
-      newPoAData = {
-        round_initial_subtime: poaData.round_initial_subtime,
-        subblock_subtime: poaData.subblock_subtime + 1n,
-        subblock_index: poaData.subblock_index + 1,
-        aggregator_index: poaData.aggregator_index,
-      };
-    } else {
-      // New block in new round
-      newPoAData = {
-        round_initial_subtime: medianTime,
-        subblock_subtime: medianTime,
-        subblock_index: 0,
-        aggregator_index: aggregatorIndex,
-      };
+    if (indices.length === 0) {
+      throw new Error("No PoA data cell is in the lane of aggregator!");
+    }
+    for (const i of indices) {
+      txSkeleton = pushAndFix(txSkeleton, poaDataCells[i], "inputs");
+    }
+    const currentTime = currentSubtime(poaSetup, medianTimeHex, tipHeader);
+    // The PoA cell has a single since, and the witness a single batch, so
+    // all advanced PoA data cells must end up with the same subtimes.
+    const nextPoADatas = indices.map((i) =>
+      nextPoAData(
+        poaSetup,
+        poaDatas[i],
+        aggregatorIndex,
+        currentTime,
+        subblockCount
+      )
+    );
+    const { subblockSubtimes } = nextPoADatas[0];
+    for (const next of nextPoADatas) {
+      if (next.subblockSubtimes.join() !== subblockSubtimes.join()) {
+        throw new Error("PoA data cells are out of sync!");
+      }
+    }
+    const poaWitness: PoAWitness = {};
+    if (subblockCount > 1) {
+      poaWitness.subblock_subtimes = subblockSubtimes;
+    }
+    // With header time, tipHeader is kept in header deps, since then only
+    // needs to be within max_header_age of its timestamp.
+    let sinceValue = subblockSubtimes[subblockCount - 1];
+    if (poaSetup.max_header_age !== undefined) {
+      let headerDepIndex = txSkeleton
+        .get("headerDeps")
+        .indexOf(tipHeader!.hash);
+      if (headerDepIndex < 0) {
+        headerDepIndex = txSkeleton.get("headerDeps").count();
+        txSkeleton = txSkeleton.update("headerDeps", (headerDeps) =>
+          headerDeps.push(tipHeader!.hash)
+        );
+      }
+      // Header dep 0 is used when the index is missing.
+      if (headerDepIndex > 0) {
+        poaWitness.header_dep_index = headerDepIndex;
+      }
+      const maxHeaderAge = BigInt(poaSetup.max_header_age);
+      sinceValue = sinceValue > maxHeaderAge ? sinceValue - maxHeaderAge : 0n;
     }
+    // Without PoA witness entries, dummy witness holds the place for input
+    // cell.
+    const witness =
+      Object.keys(poaWitness).length > 0
+        ? serializePoAWitnessArgs(poaWitness)
+        : "0x";
+    txSkeleton = txSkeleton.update("witnesses", (witnesses) =>
+      witnesses.push(witness)
+    );
     // Update PoA cell since time
-    // TODO: block interval handling
     txSkeleton = txSkeleton.update("inputSinces", (inputSinces) => {
       return inputSinces.set(
         0,
         since.generateSince({
           relative: false,
-          type: "blockTimestamp",
-          value: newPoAData.subblock_subtime,
+          type: poaSetup.round_interval_uses_seconds
+            ? "blockTimestamp"
+            : "blockNumber",
+          value: sinceValue,
         })
       );
     });
-    const newPackedPoAData = new Reader(
-      serializePoAData(newPoAData)
-    ).serializeJson();
-    const newPoADataCell = {
-      cell_output: poaDataCell.cell_output,
-      data: newPackedPoAData,
-    };
-    txSkeleton = pushAndFix(txSkeleton, newPoADataCell, "outputs");
+    indices.forEach((dataCellIndex, i) => {
+      const newPoADataCell = {
+        cell_output: poaDataCells[dataCellIndex].cell_output,
+        data: new Reader(
+          serializePoAData(nextPoADatas[i].newPoAData)
+        ).serializeJson(),
+      };
+      txSkeleton = pushAndFix(txSkeleton, newPoADataCell, "outputs");
+    });
+    // Aggregators with signature identities sign the transaction via
+    // signWitness instead of providing an owner cell.
+    if (poaSetup.signature_code_hash) {
+      return txSkeleton;
+    }
     // Add one owner cell if not exists already
     const ownerCells = txSkeleton.get("inputs").filter((cell) => {
       const currentScriptHash = utils.computeScriptHash(cell.cell_output.lock);
@@ -189,33 +443,149 @@ export class PoAGenerator {
     return txSkeleton;
   }
 
-  async _queryPoAInfos(tipCell: Cell) {
-    const poaDataCellTypeHash = new Reader(
-      new Reader(tipCell.cell_output.lock.args).toArrayBuffer().slice(32)
+  // Fills cell index hints in the PoA cell's witness, so the on chain script
+  // only needs to check the hinted cells instead of scanning all of them. This
+  // must be called after all cells are added to the transaction skeleton,
+  // since the hints refer to final positions of cells. Other entries already
+  // in the witness, such as a subblock batch, are kept. With lanes, PoA data
+  // cells of other lanes are left out of the transaction and hinted as
+  // skipped.
+  async fillWitnessHints(
+    txSkeleton: TransactionSkeletonType
+  ): Promise<TransactionSkeletonType> {
+    const { poaDataCells, poaSetup, poaSetupCell } = await this._queryPoAInfos(
+      txSkeleton.get("inputs").get(0)!
     );
-    if (poaDataCellTypeHash.length() !== 32) {
-      throw new Error("Invalid PoA cell lock args!");
+    const setupDepIndex = txSkeleton
+      .get("cellDeps")
+      .findIndex((cellDep) =>
+        isSameOutPoint(cellDep.out_point, poaSetupCell.out_point!)
+      );
+    if (setupDepIndex < 0) {
+      throw new Error("PoA cells are missing in transaction skeleton!");
+    }
+    const dataCellHints: Array<PoADataCellHints> = [];
+    const dataInputIndices: Array<number> = [];
+    for (const poaDataCell of poaDataCells) {
+      const dataInputIndex = txSkeleton
+        .get("inputs")
+        .findIndex((cell) =>
+          isSameOutPoint(cell.out_point!, poaDataCell.out_point!)
+        );
+      if (dataInputIndex < 0 && (poaSetup.lane_count || 1) > 1) {
+        dataCellHints.push({
+          input_index: POA_SKIPPED_DATA_CELL_INDEX,
+          output_index: POA_SKIPPED_DATA_CELL_INDEX,
+        });
+        continue;
+      }
+      const dataTypeHash = utils.computeScriptHash(
+        poaDataCell.cell_output.type!
+      );
+      const dataOutputIndex = txSkeleton
+        .get("outputs")
+        .findIndex(
+          (cell) =>
+            !!cell.cell_output.type &&
+            utils.computeScriptHash(cell.cell_output.type) === dataTypeHash
+        );
+      if (dataInputIndex < 0 || dataOutputIndex < 0) {
+        throw new Error("PoA cells are missing in transaction skeleton!");
+      }
+      dataCellHints.push({
+        input_index: dataInputIndex,
+        output_index: dataOutputIndex,
+      });
+      dataInputIndices.push(dataInputIndex);
     }
-    const poaDataCell = await this._queryPoaStateCell(
-      poaDataCellTypeHash.serializeJson()
+    const poaWitness = parsePoAWitnessArgs(
+      txSkeleton.get("witnesses").get(0) || "0x"
+    );
+    const witness = serializePoAWitnessArgs({
+      ...poaWitness,
+      normal_hints: {
+        setup_dep_index: setupDepIndex,
+        data_cells: dataCellHints,
+      },
+    });
+    return txSkeleton.update("witnesses", (witnesses) => {
+      witnesses = witnesses.set(0, witness);
+      // PoA data cells are unlocked by state lock, which can then check the
+      // PoA cell at input 0 directly. Witnesses used by others are kept.
+      for (const dataInputIndex of dataInputIndices) {
+        if ((witnesses.get(dataInputIndex) || "0x") === "0x") {
+          while (witnesses.size < dataInputIndex) {
+            witnesses = witnesses.push("0x");
+          }
+          witnesses = witnesses.set(dataInputIndex, serializeStateLockHint(0));
+        }
+      }
+      return witnesses;
+    });
+  }
+
+  // Signs the PoA cell's witness with signature identities. This must be the
+  // last step before sending the transaction, since the signature commits to
+  // the transaction hash and all other entries in PoA witness.
+  async signWitness(
+    txSkeleton: TransactionSkeletonType,
+    sign: (message: Hash) => Promise<HexString>
+  ): Promise<TransactionSkeletonType> {
+    const poaWitness = parsePoAWitnessArgs(
+      txSkeleton.get("witnesses").get(0) || "0x"
     );
-    const poaData = parsePoAData(new Reader(poaDataCell.data).toArrayBuffer());
-    const poaSetupCellTypeHash = new Reader(
-      new Reader(tipCell.cell_output.lock.args).toArrayBuffer().slice(0, 32)
+    const tx = createTransactionFromSkeleton(txSkeleton);
+    const txHash = utils.ckbHash(
+      core.SerializeRawTransaction(
+        normalizers.NormalizeRawTransaction({
+          version: tx.version,
+          cell_deps: tx.cell_deps,
+          header_deps: tx.header_deps,
+          inputs: tx.inputs,
+          outputs: tx.outputs,
+          outputs_data: tx.outputs_data,
+        })
+      )
+    ).serializeJson();
+    const signature = await sign(calculateSigningMessage(txHash, poaWitness));
+    const witness = serializePoAWitnessArgs({ ...poaWitness, signature });
+    return txSkeleton.update("witnesses", (witnesses) =>
+      witnesses.set(0, witness)
     );
+  }
+
+  // PoA lock args contain the type ID args of PoA setup cell, followed by
+  // the type ID args of one or more PoA data cells.
+  async _queryPoAInfos(tipCell: Cell) {
+    const args = new Reader(tipCell.cell_output.lock.args).toArrayBuffer();
+    if (args.byteLength < 64 || args.byteLength % 32 !== 0) {
+      throw new Error("Invalid PoA cell lock args!");
+    }
+    const poaDataCells: Array<Cell> = [];
+    const poaDatas: Array<PoAData> = [];
+    for (let offset = 32; offset < args.byteLength; offset += 32) {
+      const poaDataCell = await this._queryPoaStateCell(
+        new Reader(args.slice(offset, offset + 32)).serializeJson()
+      );
+      poaDataCells.push(poaDataCell);
+      poaDatas.push(parsePoAData(new Reader(poaDataCell.data).toArrayBuffer()));
+    }
+    const poaSetupCellTypeHash = new Reader(args.slice(0, 32));
     const poaSetupCell = await this._queryPoaStateCell(
       poaSetupCellTypeHash.serializeJson()
     );
     const poaSetup = parsePoASetup(
       new Reader(poaSetupCell.data).toArrayBuffer()
     );
-    if (!poaSetup.round_interval_uses_seconds) {
-      throw new Error("TODO: implement block interval PoA");
-    }
     let script = addressToScript(this.ckbAddress);
     let scriptHash = utils.computeScriptHash(script);
+    // Signature identities are public key hashes, which are kept in args of
+    // default secp256k1 lock.
+    const identitySource = poaSetup.signature_code_hash
+      ? script.args
+      : scriptHash;
     let truncatedScriptHash = new Reader(
-      new Reader(scriptHash).toArrayBuffer().slice(0, poaSetup.identity_size)
+      new Reader(identitySource).toArrayBuffer().slice(0, poaSetup.identity_size)
     ).serializeJson();
     const aggregatorIndex = poaSetup.identities.findIndex(
       (identity) => identity === truncatedScriptHash
@@ -224,8 +594,8 @@ export class PoAGenerator {
       throw new Error("Specified identity cannot be located!");
     }
     return {
-      poaData,
-      poaDataCell,
+      poaDatas,
+      poaDataCells,
       poaSetup,
       poaSetupCell,
       aggregatorIndex,
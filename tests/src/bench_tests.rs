@@ -0,0 +1,800 @@
+use super::poa_tests::{
+    build_poa_witness, serialize_poa_data, serialize_poa_setup, serialize_uint32s, sign_message,
+    sign_poa_transaction, signature_identity, signature_library, signature_library_hash, PoAData,
+    PoASetup,
+};
+use super::*;
+use ckb_testtool::{builtin::ALWAYS_SUCCESS, context::Context};
+use ckb_tool::ckb_crypto::secp::{Generator, Privkey};
+use ckb_tool::ckb_types::{
+    bytes::{Bytes, BytesMut},
+    core::{ScriptHashType, TransactionBuilder},
+    h256,
+    packed::*,
+    prelude::*,
+};
+
+// Large enough for the worst shapes below, the cap here is CKB's block
+// cycle limit rather than the 10M used by functional tests.
+const BENCH_MAX_CYCLES: u64 = 3_500_000_000;
+const BENCH_UPDATE_VAR: &str = "CLERKB_BENCH_UPDATE";
+
+const AGGREGATOR_SWEEP: &[usize] = &[1, 16, 64, 255];
+const INPUT_SWEEP: &[usize] = &[1, 10, 100, 500];
+const CELL_DEP_SWEEP: &[usize] = &[1, 10, 100];
+
+const BENCH_BINARIES: &[&str] = &[
+    "poa.strip",
+    "state.strip",
+    "poa_state.strip",
+    "poa_32_21.strip",
+];
+// Aggregator number fixed in the specialized build benchmarked above.
+const SPECIALIZED_AGGREGATORS: usize = 21;
+
+#[derive(Clone, Copy, PartialEq)]
+enum Flow {
+    // Aggregator issues one more subblock in its own round.
+    NormalSubblock,
+    // Next aggregator takes over with the first subblock of a new round.
+    NewRound,
+    // Aggregators jointly update the PoA setup cell.
+    SetupUpdate,
+    // State lock unlocking a PoA data cell.
+    State,
+}
+
+impl Flow {
+    fn name(&self) -> &'static str {
+        match self {
+            Flow::NormalSubblock => "poa_normal_subblock",
+            Flow::NewRound => "poa_new_round",
+            Flow::SetupUpdate => "poa_setup_update",
+            Flow::State => "state_unlock",
+        }
+    }
+}
+
+// Transaction shape used in a single benchmark scenario. `inputs` and
+// `cell_deps` count unrelated cells added on top of the ones each flow
+// requires, they are placed so PoA scripts have to scan past all of them.
+#[derive(Clone, Copy)]
+struct Shape {
+    aggregators: usize,
+    inputs: usize,
+    cell_deps: usize,
+}
+
+// Optional on-chain features exercised on top of the default layout.
+#[derive(Clone, Copy, PartialEq)]
+enum Variant {
+    Default,
+    // Setup stores identities sorted, enabling binary search.
+    SortedIdentities,
+    // PoA witness carries cell index hints.
+    Hints,
+    // Aggregators sign subblocks instead of providing owner cells.
+    SignatureIdentities,
+    // Runs the combined build of PoA lock and state lock.
+    Combined,
+    // Runs the build specialized for SPECIALIZED_AGGREGATORS aggregators.
+    Specialized,
+}
+
+impl Variant {
+    fn suffix(&self) -> &'static str {
+        match self {
+            Variant::Default => "",
+            Variant::SortedIdentities => "/sorted_identities",
+            Variant::Hints => "/hints",
+            Variant::SignatureIdentities => "/signature_identities",
+            Variant::Combined => "/combined",
+            Variant::Specialized => "/specialized",
+        }
+    }
+}
+
+struct Scenario {
+    flow: Flow,
+    shape: Shape,
+    variant: Variant,
+}
+
+impl Scenario {
+    fn name(&self) -> String {
+        let name = match self.flow {
+            Flow::State => format!(
+                "{}/inputs={}/cell_deps={}",
+                self.flow.name(),
+                self.shape.inputs,
+                self.shape.cell_deps
+            ),
+            _ => format!(
+                "{}/aggregators={}/inputs={}/cell_deps={}",
+                self.flow.name(),
+                self.shape.aggregators,
+                self.shape.inputs,
+                self.shape.cell_deps
+            ),
+        };
+        format!("{}{}", name, self.variant.suffix())
+    }
+}
+
+fn scenarios() -> Vec<Scenario> {
+    let mut result = vec![];
+    for flow in &[
+        Flow::NormalSubblock,
+        Flow::NewRound,
+        Flow::SetupUpdate,
+        Flow::State,
+    ] {
+        let base = Shape {
+            aggregators: 1,
+            inputs: 1,
+            cell_deps: 1,
+        };
+        result.push(Scenario {
+            flow: *flow,
+            shape: base,
+            variant: Variant::Default,
+        });
+        if *flow != Flow::State {
+            for aggregators in &AGGREGATOR_SWEEP[1..] {
+                result.push(Scenario {
+                    flow: *flow,
+                    shape: Shape {
+                        aggregators: *aggregators,
+                        ..base
+                    },
+                    variant: Variant::Default,
+                });
+            }
+        }
+        for inputs in &INPUT_SWEEP[1..] {
+            result.push(Scenario {
+                flow: *flow,
+                shape: Shape {
+                    inputs: *inputs,
+                    ..base
+                },
+                variant: Variant::Default,
+            });
+        }
+        for cell_deps in &CELL_DEP_SWEEP[1..] {
+            result.push(Scenario {
+                flow: *flow,
+                shape: Shape {
+                    cell_deps: *cell_deps,
+                    ..base
+                },
+                variant: Variant::Default,
+            });
+        }
+        result.push(Scenario {
+            flow: *flow,
+            shape: Shape {
+                aggregators: AGGREGATOR_SWEEP[AGGREGATOR_SWEEP.len() - 1],
+                inputs: INPUT_SWEEP[INPUT_SWEEP.len() - 1],
+                cell_deps: CELL_DEP_SWEEP[CELL_DEP_SWEEP.len() - 1],
+            },
+            variant: Variant::Default,
+        });
+    }
+    // Consensus mode with identities located via binary search, compare
+    // against the linear scan of the same aggregator numbers above.
+    for aggregators in &AGGREGATOR_SWEEP[1..] {
+        result.push(Scenario {
+            flow: Flow::SetupUpdate,
+            shape: Shape {
+                aggregators: *aggregators,
+                inputs: 1,
+                cell_deps: 1,
+            },
+            variant: Variant::SortedIdentities,
+        });
+    }
+    // Cell index hints on the flows that scan inputs, compare against the
+    // same input counts above.
+    for flow in &[Flow::NormalSubblock, Flow::NewRound, Flow::State] {
+        for inputs in INPUT_SWEEP {
+            result.push(Scenario {
+                flow: *flow,
+                shape: Shape {
+                    aggregators: 1,
+                    inputs: *inputs,
+                    cell_deps: 1,
+                },
+                variant: Variant::Hints,
+            });
+        }
+    }
+    // Signatures checked via the dynamically loaded secp256k1 library,
+    // compare against owner cells of the same aggregator numbers above.
+    for flow in &[Flow::NormalSubblock, Flow::NewRound] {
+        for aggregators in AGGREGATOR_SWEEP {
+            result.push(Scenario {
+                flow: *flow,
+                shape: Shape {
+                    aggregators: *aggregators,
+                    inputs: 1,
+                    cell_deps: 1,
+                },
+                variant: Variant::SignatureIdentities,
+            });
+        }
+    }
+    // Both roles of the combined build, compare against the default layout
+    // above to see the cost of loading the larger binary.
+    for flow in &[Flow::NormalSubblock, Flow::NewRound, Flow::State] {
+        result.push(Scenario {
+            flow: *flow,
+            shape: Shape {
+                aggregators: 1,
+                inputs: 1,
+                cell_deps: 1,
+            },
+            variant: Variant::Combined,
+        });
+    }
+    // The specialized build next to the generic one, for the aggregator
+    // number it is built for.
+    for flow in &[Flow::NormalSubblock, Flow::NewRound, Flow::SetupUpdate] {
+        for variant in &[Variant::Default, Variant::Specialized] {
+            result.push(Scenario {
+                flow: *flow,
+                shape: Shape {
+                    aggregators: SPECIALIZED_AGGREGATORS,
+                    inputs: 1,
+                    cell_deps: 1,
+                },
+                variant: *variant,
+            });
+        }
+    }
+    result
+}
+
+fn binary_name(scenario: &Scenario) -> &'static str {
+    match (scenario.variant, scenario.flow) {
+        (Variant::Combined, _) => "poa_state.strip",
+        (Variant::Specialized, _) => "poa_32_21.strip",
+        (_, Flow::State) => "state.strip",
+        _ => "poa.strip",
+    }
+}
+
+fn type_id_script(args: &Bytes) -> Script {
+    Script::new_builder()
+        .code_hash(h256!("0x545950455f4944").pack())
+        .hash_type(ScriptHashType::Type.into())
+        .args(args.pack())
+        .build()
+}
+
+fn type_id_cell(capacity: u64, lock: &Script, type_id: &Script) -> CellOutput {
+    CellOutput::new_builder()
+        .capacity(capacity.pack())
+        .lock(lock.clone())
+        .type_(ScriptOpt::new_builder().set(Some(type_id.clone())).build())
+        .build()
+}
+
+fn plain_input(context: &mut Context, lock: &Script, data: Bytes) -> CellInput {
+    let out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(500u64.pack())
+            .lock(lock.clone())
+            .build(),
+        data,
+    );
+    CellInput::new_builder().previous_output(out_point).build()
+}
+
+fn filler_inputs(context: &mut Context, lock: &Script, count: usize) -> Vec<CellInput> {
+    (0..count)
+        .map(|_| plain_input(context, lock, Bytes::new()))
+        .collect()
+}
+
+fn filler_deps(context: &mut Context, lock: &Script, count: usize) -> Vec<CellDep> {
+    (0..count)
+        .map(|_| {
+            let out_point = context.create_cell(
+                CellOutput::new_builder()
+                    .capacity(500u64.pack())
+                    .lock(lock.clone())
+                    .build(),
+                random_32bytes(),
+            );
+            CellDep::new_builder().out_point(out_point).build()
+        })
+        .collect()
+}
+
+fn build_state_transaction(loader: &Loader, scenario: &Scenario) -> (Context, TransactionView) {
+    let shape = &scenario.shape;
+    let mut context = Context::default();
+    let state_bin: Bytes = loader.load_binary(binary_name(scenario));
+    let state_out_point = context.deploy_cell(state_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    let target_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let filler_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let state_lock_script = context
+        .build_script(
+            &state_out_point,
+            target_lock_script.calc_script_hash().as_bytes(),
+        )
+        .expect("build script");
+
+    let state_input = plain_input(&mut context, &state_lock_script, Bytes::new());
+    let fillers = filler_inputs(&mut context, &filler_lock_script, shape.inputs);
+    let target_input = plain_input(&mut context, &target_lock_script, Bytes::new());
+    let deps = filler_deps(&mut context, &filler_lock_script, shape.cell_deps);
+    let witness = if scenario.variant == Variant::Hints {
+        WitnessArgs::new_builder()
+            .lock(
+                Some(Bytes::from(
+                    (1 + shape.inputs as u32).to_le_bytes().to_vec(),
+                ))
+                .pack(),
+            )
+            .build()
+            .as_bytes()
+    } else {
+        Bytes::new()
+    };
+
+    let tx = TransactionBuilder::default()
+        .input(state_input)
+        .witness(witness.pack())
+        .inputs(fillers)
+        .input(target_input)
+        .output(
+            CellOutput::new_builder()
+                .capacity(500u64.pack())
+                .lock(filler_lock_script.clone())
+                .build(),
+        )
+        .output_data(Bytes::new().pack())
+        .cell_deps(deps)
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(state_out_point.clone())
+                .build(),
+        )
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(always_success_out_point.clone())
+                .build(),
+        )
+        .build();
+    let tx = context.complete_tx(tx);
+    (context, tx)
+}
+
+fn build_poa_transaction(loader: &Loader, scenario: &Scenario) -> (Context, TransactionView) {
+    let flow = scenario.flow;
+    let shape = &scenario.shape;
+    let mut context = Context::default();
+    let poa_bin: Bytes = loader.load_binary(binary_name(scenario));
+    let poa_out_point = context.deploy_cell(poa_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    let mut owner_scripts: Vec<Script> = (0..shape.aggregators)
+        .map(|_| {
+            context
+                .build_script(&always_success_out_point, random_32bytes())
+                .expect("build script")
+        })
+        .collect();
+    let identities_sorted = scenario.variant == Variant::SortedIdentities;
+    if identities_sorted {
+        owner_scripts.sort_by_key(|script| script.calc_script_hash().as_bytes());
+    }
+    let signature_identities = scenario.variant == Variant::SignatureIdentities;
+    let keys: Vec<Privkey> = if signature_identities {
+        (0..shape.aggregators)
+            .map(|_| Generator::random_privkey())
+            .collect()
+    } else {
+        vec![]
+    };
+    let simple_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let poa_setup_type_id_args = random_32bytes();
+    let poa_data_type_id_args = random_32bytes();
+    let poa_setup_type_id_script = type_id_script(&poa_setup_type_id_args);
+    let poa_data_type_id_script = type_id_script(&poa_data_type_id_args);
+    let poa_lock_data = {
+        let mut buffer = BytesMut::new();
+        buffer.extend_from_slice(&poa_setup_type_id_args);
+        buffer.extend_from_slice(&poa_data_type_id_args);
+        buffer.freeze()
+    };
+    let poa_lock_script = context
+        .build_script(&poa_out_point, poa_lock_data)
+        .expect("build script");
+
+    let setup = |round_intervals: u32| {
+        let (identity_size, identities, signature_code_hash) = if signature_identities {
+            (
+                20,
+                keys.iter().map(signature_identity).collect(),
+                Some(signature_library_hash()),
+            )
+        } else {
+            (
+                32,
+                owner_scripts
+                    .iter()
+                    .map(|script| script.calc_script_hash().as_bytes())
+                    .collect(),
+                None,
+            )
+        };
+        serialize_poa_setup(&PoASetup {
+            identity_size,
+            round_interval_uses_seconds: true,
+            identities_sorted,
+            identities,
+            aggregator_change_threshold: shape.aggregators as u8,
+            round_intervals,
+            subblocks_per_round: 2,
+            signature_code_hash,
+            ..Default::default()
+        })
+    };
+
+    let mut builder = TransactionBuilder::default();
+    let mut signer_key = None;
+    if flow == Flow::SetupUpdate {
+        let setup_out_point = context.create_cell(
+            type_id_cell(1000, &simple_lock_script, &poa_setup_type_id_script),
+            setup(90),
+        );
+        let poa_input = plain_input(&mut context, &poa_lock_script, Bytes::from_static(b"old"));
+        let fillers = filler_inputs(&mut context, &simple_lock_script, shape.inputs);
+        let owner_inputs: Vec<CellInput> = owner_scripts
+            .iter()
+            .map(|script| plain_input(&mut context, script, Bytes::new()))
+            .collect();
+        builder = builder
+            .input(
+                CellInput::new_builder()
+                    .previous_output(setup_out_point)
+                    .build(),
+            )
+            .input(poa_input)
+            .inputs(fillers)
+            .inputs(owner_inputs)
+            .output(
+                CellOutput::new_builder()
+                    .capacity(1000u64.pack())
+                    .lock(poa_lock_script.clone())
+                    .build(),
+            )
+            .output_data(Bytes::from_static(b"new").pack())
+            .output(type_id_cell(
+                1000,
+                &simple_lock_script,
+                &poa_setup_type_id_script,
+            ))
+            .output_data(setup(47).pack());
+    } else {
+        let last_aggregator = shape.aggregators - 1;
+        let (last_data, current_data) = if flow == Flow::NormalSubblock {
+            (
+                PoAData {
+                    round_initial_subtime: 1000,
+                    subblock_subtime: 1000,
+                    subblock_index: 0,
+                    aggregator_index: last_aggregator as u16,
+                },
+                PoAData {
+                    round_initial_subtime: 1000,
+                    subblock_subtime: 1010,
+                    subblock_index: 1,
+                    aggregator_index: last_aggregator as u16,
+                },
+            )
+        } else {
+            let next_aggregator = (last_aggregator + 1) % shape.aggregators;
+            (
+                PoAData {
+                    round_initial_subtime: 1000,
+                    subblock_subtime: 1000,
+                    subblock_index: 0,
+                    aggregator_index: last_aggregator as u16,
+                },
+                PoAData {
+                    round_initial_subtime: 1090,
+                    subblock_subtime: 1090,
+                    subblock_index: 0,
+                    aggregator_index: next_aggregator as u16,
+                },
+            )
+        };
+        let signer_index = current_data.aggregator_index as usize;
+
+        let setup_out_point = context.create_cell(
+            type_id_cell(1000, &simple_lock_script, &poa_setup_type_id_script),
+            setup(90),
+        );
+        let poa_input_out_point = context.create_cell(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(poa_lock_script.clone())
+                .build(),
+            Bytes::from_static(b"old"),
+        );
+        let poa_input = CellInput::new_builder()
+            .previous_output(poa_input_out_point)
+            .since((0x4000000000000000u64 | current_data.subblock_subtime).pack())
+            .build();
+        let data_input_out_point = context.create_cell(
+            type_id_cell(1000, &simple_lock_script, &poa_data_type_id_script),
+            serialize_poa_data(&last_data),
+        );
+        let fillers = filler_inputs(&mut context, &simple_lock_script, shape.inputs);
+        let deps = filler_deps(&mut context, &simple_lock_script, shape.cell_deps);
+        let mut owner_input = None;
+        let mut signature_dep = None;
+        if signature_identities {
+            // The signature replaces the owner input, and is filled once the
+            // transaction hash is known.
+            let signature_out_point = context.deploy_cell(signature_library());
+            signature_dep = Some(
+                CellDep::new_builder()
+                    .out_point(signature_out_point)
+                    .build(),
+            );
+            builder = builder.witness(Bytes::new().pack());
+            signer_key = Some(&keys[signer_index]);
+        } else {
+            owner_input = Some(plain_input(
+                &mut context,
+                &owner_scripts[signer_index],
+                Bytes::new(),
+            ));
+        }
+        if scenario.variant == Variant::Hints {
+            // Setup cell comes right after filler deps, data cell is always
+            // input 1 and output 1.
+            builder = builder.witness(
+                build_poa_witness(&[(1, serialize_uint32s(&[shape.cell_deps as u32, 1, 1]))])
+                    .pack(),
+            );
+        }
+        builder = builder
+            .input(poa_input)
+            .input(
+                CellInput::new_builder()
+                    .previous_output(data_input_out_point)
+                    .build(),
+            )
+            .inputs(fillers)
+            .inputs(owner_input)
+            .output(
+                CellOutput::new_builder()
+                    .capacity(1000u64.pack())
+                    .lock(poa_lock_script.clone())
+                    .build(),
+            )
+            .output_data(Bytes::from_static(b"new").pack())
+            .output(type_id_cell(
+                1000,
+                &simple_lock_script,
+                &poa_data_type_id_script,
+            ))
+            .output_data(serialize_poa_data(&current_data).pack())
+            .cell_deps(deps)
+            .cell_dep(CellDep::new_builder().out_point(setup_out_point).build())
+            .cell_deps(signature_dep);
+    }
+    let tx = builder
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(poa_out_point.clone())
+                .build(),
+        )
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(always_success_out_point.clone())
+                .build(),
+        )
+        .build();
+    let tx = context.complete_tx(tx);
+    let tx = match signer_key {
+        Some(key) => sign_poa_transaction(tx, 0, &[], 4, |message| sign_message(key, message)),
+        None => tx,
+    };
+    (context, tx)
+}
+
+fn run_scenario(loader: &Loader, scenario: &Scenario) -> u64 {
+    let (context, tx) = match scenario.flow {
+        Flow::State => build_state_transaction(loader, scenario),
+        _ => build_poa_transaction(loader, scenario),
+    };
+    context
+        .verify_tx(&tx, BENCH_MAX_CYCLES)
+        .unwrap_or_else(|e| panic!("{} fails verification: {:?}", scenario.name(), e))
+}
+
+fn test_env_name() -> String {
+    env::var(TEST_ENV_VAR)
+        .unwrap_or_else(|_| "debug".to_string())
+        .to_lowercase()
+}
+
+fn baseline_path() -> PathBuf {
+    let test_env = test_env_name();
+    let mut path = env::current_dir().unwrap();
+    path.push("..");
+    path.push("scripts");
+    path.push(format!("cycles_{}.txt", test_env));
+    path
+}
+
+// Baseline files use the same layout as checksums.txt: a value, 2 spaces,
+// then the name. Lines starting with # are comments.
+fn read_baseline(path: &Path) -> Vec<(String, u64)> {
+    let content = match fs::read_to_string(path) {
+        Ok(content) => content,
+        Err(_) => return vec![],
+    };
+    content
+        .lines()
+        .filter(|line| !line.trim().is_empty() && !line.starts_with('#'))
+        .map(|line| {
+            let mut parts = line.splitn(2, "  ");
+            let cycles = parts
+                .next()
+                .and_then(|cycles| cycles.parse().ok())
+                .unwrap_or_else(|| panic!("invalid baseline line: {}", line));
+            let name = parts
+                .next()
+                .unwrap_or_else(|| panic!("invalid baseline line: {}", line));
+            (name.to_string(), cycles)
+        })
+        .collect()
+}
+
+fn format_results(results: &[(String, u64)]) -> String {
+    let mut content = String::from("# Generated by `make bench-update`, do not edit by hand.\n");
+    for (name, cycles) in results {
+        content.push_str(&format!("{}  {}\n", cycles, name));
+    }
+    content
+}
+
+#[test]
+#[ignore]
+fn bench_cycles() {
+    let loader = Loader::default();
+    let results: Vec<(String, u64)> = scenarios()
+        .iter()
+        .map(|scenario| (scenario.name(), run_scenario(&loader, scenario)))
+        .collect();
+
+    let path = baseline_path();
+    if env::var(BENCH_UPDATE_VAR).is_ok() {
+        fs::write(&path, format_results(&results)).expect("write baseline");
+        println!("Baseline updated: {}", path.to_str().expect("utf8"));
+        return;
+    }
+    let baseline = read_baseline(&path);
+    // A baseline without entries has never been generated, which is a
+    // different failure from one that merely fell behind the scenarios.
+    if baseline.is_empty() {
+        panic!(
+            "Baseline {} has no entries. Run `make bench-update` with the RISC-V toolchain and commit the result.",
+            path.to_str().expect("utf8")
+        );
+    }
+    let mut regressions = vec![];
+    let mut missing = vec![];
+    println!(
+        "{:>12} {:>12} {:>8}  scenario",
+        "baseline", "cycles", "change"
+    );
+    for (name, cycles) in &results {
+        match baseline
+            .iter()
+            .find(|(baseline_name, _)| baseline_name == name)
+        {
+            Some((_, expected)) => {
+                println!(
+                    "{:>12} {:>12} {:>7.2}%  {}",
+                    expected,
+                    cycles,
+                    change_percent(*expected, *cycles),
+                    name
+                );
+                if cycles > expected {
+                    regressions.push(name.clone());
+                }
+            }
+            None => {
+                println!("{:>12} {:>12} {:>8}  {}", "-", cycles, "missing", name);
+                missing.push(name.clone());
+            }
+        }
+    }
+    // Scenarios that are in the baseline but no longer run indicate a stale
+    // baseline just like new scenarios do.
+    let stale: Vec<String> = baseline
+        .iter()
+        .filter(|(baseline_name, _)| !results.iter().any(|(name, _)| name == baseline_name))
+        .map(|(baseline_name, _)| baseline_name.clone())
+        .collect();
+    for name in &stale {
+        println!("{:>12} {:>12} {:>8}  {}", "-", "-", "stale", name);
+    }
+    if !missing.is_empty() || !stale.is_empty() {
+        panic!(
+            "Baseline {} is out of date, missing: [{}], stale: [{}]. Run `make bench-update` to regenerate it.",
+            path.to_str().expect("utf8"),
+            missing.join(", "),
+            stale.join(", ")
+        );
+    }
+    if !regressions.is_empty() {
+        panic!(
+            "Cycle regressions found in: {}. Run `make bench-update` if this is intended.",
+            regressions.join(", ")
+        );
+    }
+}
+
+fn change_percent(from: u64, to: u64) -> f64 {
+    (to as f64 - from as f64) * 100.0 / (from as f64)
+}
+
+// Prints binary sizes and cycles of the release build next to the debug
+// build, both environments are run in the same pass. Regressions are left to
+// `make bench` in each environment, which checks against its own baseline.
+#[test]
+#[ignore]
+fn bench_release() {
+    let debug_loader = Loader::with_test_env(TestEnv::Debug);
+    let release_loader = Loader::with_test_env(TestEnv::Release);
+    println!("{:>12} {:>12} {:>8}  binary", "debug", "release", "change");
+    for name in BENCH_BINARIES {
+        let debug_size = fs::metadata(debug_loader.path(name))
+            .expect("debug binary")
+            .len();
+        let release_size = fs::metadata(release_loader.path(name))
+            .expect("release binary")
+            .len();
+        println!(
+            "{:>12} {:>12} {:>7.2}%  {}",
+            debug_size,
+            release_size,
+            change_percent(debug_size, release_size),
+            name
+        );
+    }
+    println!(
+        "{:>12} {:>12} {:>8}  scenario",
+        "debug", "release", "change"
+    );
+    for scenario in scenarios() {
+        let debug_cycles = run_scenario(&debug_loader, &scenario);
+        let release_cycles = run_scenario(&release_loader, &scenario);
+        println!(
+            "{:>12} {:>12} {:>7.2}%  {}",
+            debug_cycles,
+            release_cycles,
+            change_percent(debug_cycles, release_cycles),
+            scenario.name()
+        );
+    }
+}
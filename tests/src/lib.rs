@@ -5,6 +5,7 @@ use ckb_standalone_debugger::transaction::{
     MockCellDep, MockInfo, MockInput, MockTransaction, ReprMockTransaction,
 };
 use ckb_testtool::context::Context;
+use ckb_tool::ckb_traits::HeaderProvider;
 use ckb_tool::ckb_types::{
     bytes::Bytes,
     core::{DepType, TransactionView},
@@ -22,6 +23,8 @@ use std::str::FromStr;
 // #[cfg(test)]
 // mod hash_tests;
 #[cfg(test)]
+mod bench_tests;
+#[cfg(test)]
 mod poa_tests;
 #[cfg(test)]
 mod state_tests;
@@ -144,7 +147,11 @@ pub fn build_mock_transaction(tx: &TransactionView, context: &Context) -> MockTr
     let mock_info = MockInfo {
         inputs: mock_inputs,
         cell_deps: mock_cell_deps,
-        header_deps: vec![],
+        header_deps: tx
+            .header_deps()
+            .into_iter()
+            .map(|hash| context.get_header(&hash).expect("get header"))
+            .collect(),
     };
     MockTransaction {
         mock_info,
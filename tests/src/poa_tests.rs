@@ -1,8 +1,10 @@
 use super::*;
+use blake2b_ref::Blake2bBuilder;
 use ckb_testtool::{builtin::ALWAYS_SUCCESS, context::Context};
+use ckb_tool::ckb_crypto::secp::{Generator, Privkey};
 use ckb_tool::ckb_types::{
     bytes::{Bytes, BytesMut},
-    core::{ScriptHashType, TransactionBuilder},
+    core::{HeaderBuilder, ScriptHashType, TransactionBuilder, TransactionView},
     h256,
     packed::*,
     prelude::*,
@@ -13,49 +15,157 @@ use std::collections::HashMap;
 
 const MAX_CYCLES: u64 = 10_000_000;
 
-struct PoASetup {
+#[derive(Default)]
+pub struct PoASetup {
     pub identity_size: u8,
     pub round_interval_uses_seconds: bool,
+    pub identities_sorted: bool,
     pub identities: Vec<Bytes>,
     pub aggregator_change_threshold: u8,
     pub round_intervals: u32,
     pub subblocks_per_round: u32,
+    // Data hash of the signature library, set for signature identities
+    pub signature_code_hash: Option<Bytes>,
+    // Only keep a Merkle root of identities in setup cell
+    pub merkle_identities: bool,
+    // Next aggregator can start right after a round uses up its subblocks
+    pub early_handoff: bool,
+    // Number of lanes advancing PoA data cells in parallel, 0 for no lanes
+    pub lane_count: u8,
+    // Length of the overlap window at the end of a round, 0 for no window
+    pub overlap_window: u32,
+    // Take subtime from a header dep, trailing since by at most this age
+    pub max_header_age: Option<u32>,
 }
 
-fn serialize_poa_setup(setup: &PoASetup) -> Bytes {
+pub fn serialize_poa_setup(setup: &PoASetup) -> Bytes {
     let mut buffer = BytesMut::new();
+    let mut flags = 0;
     if setup.round_interval_uses_seconds {
-        buffer.extend_from_slice(&[1]);
-    } else {
-        buffer.extend_from_slice(&[0]);
+        flags |= 1;
+    }
+    if setup.identities_sorted {
+        flags |= 2;
+    }
+    if setup.signature_code_hash.is_some() {
+        flags |= 4;
+    }
+    if setup.merkle_identities {
+        flags |= 8;
+    }
+    if setup.early_handoff {
+        flags |= 16;
+    }
+    if setup.lane_count > 0 {
+        flags |= 32;
+    }
+    if setup.overlap_window > 0 {
+        flags |= 64;
+    }
+    if setup.max_header_age.is_some() {
+        flags |= 128;
     }
-    if setup.identities.len() > 255 {
-        panic!("Too many identities!");
+    buffer.extend_from_slice(&[flags]);
+    if setup.merkle_identities {
+        buffer.extend_from_slice(&[setup.identity_size, 0, 0]);
+    } else {
+        if setup.identities.len() > 255 {
+            panic!("Too many identities!");
+        }
+        buffer.extend_from_slice(&[
+            setup.identity_size,
+            setup.identities.len() as u8,
+            setup.aggregator_change_threshold,
+        ]);
     }
-    buffer.extend_from_slice(&[
-        setup.identity_size,
-        setup.identities.len() as u8,
-        setup.aggregator_change_threshold,
-    ]);
     buffer.extend_from_slice(&setup.round_intervals.to_le_bytes()[..]);
     buffer.extend_from_slice(&setup.subblocks_per_round.to_le_bytes()[..]);
-    for identity in &setup.identities {
-        if identity.len() < setup.identity_size as usize {
-            panic!("Invalid identity!");
+    if !setup.merkle_identities {
+        for identity in &setup.identities {
+            if identity.len() < setup.identity_size as usize {
+                panic!("Invalid identity!");
+            }
+            buffer.extend_from_slice(&identity.slice(0..setup.identity_size as usize));
         }
-        buffer.extend_from_slice(&identity.slice(0..setup.identity_size as usize));
+    }
+    if let Some(signature_code_hash) = &setup.signature_code_hash {
+        buffer.extend_from_slice(signature_code_hash);
+    }
+    if setup.merkle_identities {
+        buffer.extend_from_slice(&(setup.identities.len() as u16).to_le_bytes()[..]);
+        buffer.extend_from_slice(&(setup.aggregator_change_threshold as u16).to_le_bytes()[..]);
+        buffer.extend_from_slice(&identities_merkle_tree(setup).last().unwrap()[0]);
+    }
+    if setup.lane_count > 0 {
+        buffer.extend_from_slice(&[setup.lane_count]);
+    }
+    if setup.overlap_window > 0 {
+        buffer.extend_from_slice(&setup.overlap_window.to_le_bytes()[..]);
+    }
+    if let Some(max_header_age) = setup.max_header_age {
+        buffer.extend_from_slice(&max_header_age.to_le_bytes()[..]);
+    }
+    buffer.freeze()
+}
+
+fn merkle_hash(prefix: u8, parts: &[&[u8]]) -> Bytes {
+    let mut blake2b = Blake2bBuilder::new(32)
+        .personal(b"ckb-default-hash")
+        .build();
+    blake2b.update(&[prefix]);
+    for part in parts {
+        blake2b.update(part);
+    }
+    let mut hash = vec![0u8; 32];
+    blake2b.finalize(&mut hash[..]);
+    Bytes::from(hash)
+}
+
+// Levels of the identity Merkle tree, from leaves to root, missing leaves are
+// filled with zeros.
+pub fn identities_merkle_tree(setup: &PoASetup) -> Vec<Vec<Bytes>> {
+    let mut level: Vec<Bytes> = setup
+        .identities
+        .iter()
+        .map(|identity| merkle_hash(0, &[&identity[0..setup.identity_size as usize]]))
+        .collect();
+    while !level.len().is_power_of_two() {
+        level.push(Bytes::from(vec![0u8; 32]));
+    }
+    let mut levels = vec![level];
+    while levels.last().unwrap().len() > 1 {
+        let level = levels
+            .last()
+            .unwrap()
+            .chunks(2)
+            .map(|pair| merkle_hash(1, &[&pair[0], &pair[1]]))
+            .collect();
+        levels.push(level);
+    }
+    levels
+}
+
+pub fn build_merkle_proof(setup: &PoASetup, index: usize) -> Bytes {
+    let mut buffer = BytesMut::new();
+    buffer.extend_from_slice(&(index as u16).to_le_bytes()[..]);
+    buffer.extend_from_slice(&setup.identities[index][0..setup.identity_size as usize]);
+    let levels = identities_merkle_tree(setup);
+    let mut current = index;
+    for level in &levels[0..levels.len() - 1] {
+        buffer.extend_from_slice(&level[current ^ 1]);
+        current >>= 1;
     }
     buffer.freeze()
 }
 
-struct PoAData {
+pub struct PoAData {
     pub round_initial_subtime: u64,
     pub subblock_subtime: u64,
     pub subblock_index: u32,
     pub aggregator_index: u16,
 }
 
-fn serialize_poa_data(data: &PoAData) -> Bytes {
+pub fn serialize_poa_data(data: &PoAData) -> Bytes {
     let mut buffer = BytesMut::new();
     buffer.extend_from_slice(&data.round_initial_subtime.to_le_bytes()[..]);
     buffer.extend_from_slice(&data.subblock_subtime.to_le_bytes()[..]);
@@ -131,6 +241,7 @@ fn test_poa_normal_update() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 1,
+            ..Default::default()
         }),
     );
     let poa_setup_dep = CellDep::new_builder()
@@ -308,6 +419,7 @@ fn test_poa_normal_update_same_round() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 3,
+            ..Default::default()
         }),
     );
     let poa_setup_dep = CellDep::new_builder()
@@ -485,6 +597,7 @@ fn test_poa_overtime_update() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 1,
+            ..Default::default()
         }),
     );
     let poa_setup_dep = CellDep::new_builder()
@@ -657,6 +770,7 @@ fn test_poa_setup_update() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 1,
+            ..Default::default()
         }),
     );
     let poa_setup_input = CellInput::new_builder()
@@ -721,6 +835,7 @@ fn test_poa_setup_update() {
             aggregator_change_threshold: 2,
             round_intervals: 47,
             subblocks_per_round: 2,
+            ..Default::default()
         }),
     ];
 
@@ -828,6 +943,7 @@ fn test_poa_invalid_aggregator_failure() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 1,
+            ..Default::default()
         }),
     );
     let poa_setup_dep = CellDep::new_builder()
@@ -1004,6 +1120,7 @@ fn test_poa_since_timestamp_failure() {
             aggregator_change_threshold: 2,
             round_intervals: 90,
             subblocks_per_round: 1,
+            ..Default::default()
         }),
     );
     let poa_setup_dep = CellDep::new_builder()
@@ -1112,3 +1229,2330 @@ fn test_poa_since_timestamp_failure() {
         true,
     );
 }
+
+// Builds a PoA setup update transaction. owner_count aggregators are created
+// using always success locks with random args, arrange_owners decides the
+// order in which they appear in the setup, and signers lists the aggregators
+// (by index in the arranged order) providing owner cells as inputs.
+fn build_setup_update_transaction<F: FnOnce(&mut Vec<Script>)>(
+    owner_count: usize,
+    arrange_owners: F,
+    identities_sorted: bool,
+    threshold: u8,
+    signers: &[usize],
+) -> (Context, TransactionView) {
+    build_setup_update_transaction_with_witness(
+        owner_count,
+        arrange_owners,
+        PoASetup {
+            identity_size: 32,
+            identities_sorted,
+            aggregator_change_threshold: threshold,
+            ..Default::default()
+        },
+        signers,
+        |_| Bytes::new(),
+    )
+}
+
+// Same as build_setup_update_transaction, except that identity size, flags,
+// threshold and optionally identities are taken from setup, and the witness
+// built from the current PoA setup is attached to the PoA cell. With signature
+// identities, the signature library is deployed and added to cell deps.
+fn build_setup_update_transaction_with_witness<F, W>(
+    owner_count: usize,
+    arrange_owners: F,
+    setup: PoASetup,
+    signers: &[usize],
+    build_witness: W,
+) -> (Context, TransactionView)
+where
+    F: FnOnce(&mut Vec<Script>),
+    W: FnOnce(&PoASetup) -> Bytes,
+{
+    build_setup_update_transaction_with_binary(
+        "poa.strip",
+        owner_count,
+        arrange_owners,
+        setup,
+        signers,
+        build_witness,
+    )
+}
+
+// Same as build_setup_update_transaction_with_witness, but the PoA lock runs
+// binary.
+fn build_setup_update_transaction_with_binary<F, W>(
+    binary: &str,
+    owner_count: usize,
+    arrange_owners: F,
+    setup: PoASetup,
+    signers: &[usize],
+    build_witness: W,
+) -> (Context, TransactionView)
+where
+    F: FnOnce(&mut Vec<Script>),
+    W: FnOnce(&PoASetup) -> Bytes,
+{
+    // deploy contract
+    let mut context = Context::default();
+    let poa_bin: Bytes = Loader::default().load_binary(binary);
+    let poa_out_point = context.deploy_cell(poa_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    // prepare scripts
+    let mut owner_scripts: Vec<Script> = (0..owner_count)
+        .map(|_| {
+            context
+                .build_script(&always_success_out_point, random_32bytes())
+                .expect("build script")
+        })
+        .collect();
+    arrange_owners(&mut owner_scripts);
+    let simple_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let poa_data_type_id_args = random_32bytes();
+    let poa_setup_type_id_args = random_32bytes();
+    let poa_setup_type_id_script = Script::new_builder()
+        .code_hash(h256!("0x545950455f4944").pack())
+        .hash_type(ScriptHashType::Type.into())
+        .args(poa_setup_type_id_args.pack())
+        .build();
+    let poa_lock_data = {
+        let mut buffer = BytesMut::new();
+        buffer.extend_from_slice(&poa_setup_type_id_args);
+        buffer.extend_from_slice(&poa_data_type_id_args);
+        buffer.freeze()
+    };
+    let poa_lock_script = context
+        .build_script(&poa_out_point, poa_lock_data)
+        .expect("build script");
+    let poa_script_dep = CellDep::new_builder()
+        .out_point(poa_out_point.clone())
+        .build();
+    let always_success_script_dep = CellDep::new_builder()
+        .out_point(always_success_out_point.clone())
+        .build();
+    // Signature identities come with keys from the caller
+    let identities: Vec<Bytes> = if setup.identities.is_empty() {
+        owner_scripts
+            .iter()
+            .map(|script| script.calc_script_hash().as_bytes())
+            .collect()
+    } else {
+        setup.identities.clone()
+    };
+    let mut extra_deps = vec![];
+    if setup.signature_code_hash.is_some() {
+        let signature_out_point = context.deploy_cell(signature_library());
+        extra_deps.push(
+            CellDep::new_builder()
+                .out_point(signature_out_point)
+                .build(),
+        );
+    }
+    let setup_cell = CellOutput::new_builder()
+        .capacity(1000u64.pack())
+        .lock(simple_lock_script.clone())
+        .type_(
+            ScriptOpt::new_builder()
+                .set(Some(poa_setup_type_id_script.clone()))
+                .build(),
+        )
+        .build();
+
+    // prepare cells
+    let current_setup = PoASetup {
+        identity_size: setup.identity_size,
+        round_interval_uses_seconds: true,
+        identities_sorted: setup.identities_sorted,
+        identities: identities.clone(),
+        aggregator_change_threshold: setup.aggregator_change_threshold,
+        round_intervals: 90,
+        subblocks_per_round: 1,
+        signature_code_hash: setup.signature_code_hash.clone(),
+        merkle_identities: setup.merkle_identities,
+        ..Default::default()
+    };
+    let witness = build_witness(&current_setup);
+    let poa_setup_out_point =
+        context.create_cell(setup_cell.clone(), serialize_poa_setup(&current_setup));
+    let poa_setup_input = CellInput::new_builder()
+        .previous_output(poa_setup_out_point)
+        .build();
+    let poa_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(poa_lock_script.clone())
+            .build(),
+        Bytes::from_static(b"old"),
+    );
+    let poa_input = CellInput::new_builder()
+        .previous_output(poa_input_out_point)
+        .build();
+    let owner_inputs: Vec<CellInput> = signers
+        .iter()
+        .map(|signer| {
+            let out_point = context.create_cell(
+                CellOutput::new_builder()
+                    .capacity(500u64.pack())
+                    .lock(owner_scripts[*signer].clone())
+                    .build(),
+                Bytes::new(),
+            );
+            CellInput::new_builder().previous_output(out_point).build()
+        })
+        .collect();
+    let outputs = vec![
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(poa_lock_script.clone())
+            .build(),
+        setup_cell,
+    ];
+
+    let outputs_data = vec![
+        Bytes::from_static(b"new"),
+        serialize_poa_setup(&PoASetup {
+            identity_size: setup.identity_size,
+            round_interval_uses_seconds: true,
+            identities_sorted: setup.identities_sorted,
+            identities,
+            aggregator_change_threshold: setup.aggregator_change_threshold,
+            round_intervals: 47,
+            subblocks_per_round: 2,
+            signature_code_hash: setup.signature_code_hash,
+            merkle_identities: setup.merkle_identities,
+            ..Default::default()
+        }),
+    ];
+
+    // build transaction
+    let tx = TransactionBuilder::default()
+        .input(poa_setup_input)
+        .input(poa_input)
+        .inputs(owner_inputs)
+        .outputs(outputs)
+        .outputs_data(outputs_data.pack())
+        .cell_dep(poa_script_dep)
+        .cell_dep(always_success_script_dep)
+        .cell_deps(extra_deps)
+        .witness(Bytes::new().pack())
+        .witness(witness.pack())
+        .build();
+    let tx = context.complete_tx(tx);
+    (context, tx)
+}
+
+#[test]
+fn test_poa_setup_update_sorted_identities() {
+    let (context, tx) = build_setup_update_transaction(
+        5,
+        |owners| owners.sort_by_key(|script| script.calc_script_hash().as_bytes()),
+        true,
+        3,
+        &[4, 0, 2],
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_sorted_identities",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_setup_update_unsorted_identities_failure() {
+    // The current setup is correctly sorted, only the new setup claims sorted
+    // identities in reverse order, committing it would lock out later setup
+    // updates.
+    let (context, tx) = build_setup_update_transaction(
+        5,
+        |owners| owners.sort_by_key(|script| script.calc_script_hash().as_bytes()),
+        true,
+        3,
+        &[4, 0, 2],
+    );
+    let mut outputs_data: Vec<Bytes> = tx
+        .outputs_data()
+        .into_iter()
+        .map(|data| data.raw_data())
+        .collect();
+    let mut new_setup = BytesMut::from(&outputs_data[1][0..12]);
+    for identity in outputs_data[1][12..].chunks(32).rev() {
+        new_setup.extend_from_slice(identity);
+    }
+    outputs_data[1] = new_setup.freeze();
+    let tx = tx
+        .as_advanced_builder()
+        .set_outputs_data(outputs_data.into_iter().map(|data| data.pack()).collect())
+        .build();
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_unsorted_identities_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_setup_update_many_aggregators() {
+    // Signers beyond index 31 used to corrupt the signer mask.
+    let signers: Vec<usize> = (0..40).rev().collect();
+    let (context, tx) = build_setup_update_transaction(40, |_| (), false, 40, &signers);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_many_aggregators",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+// Serializes PoA witness entries, and wraps them in the lock field of
+// WitnessArgs.
+pub fn build_poa_witness(entries: &[(u8, Bytes)]) -> Bytes {
+    let mut buffer = BytesMut::new();
+    for (tag, payload) in entries {
+        buffer.extend_from_slice(&[*tag]);
+        buffer.extend_from_slice(&(payload.len() as u16).to_le_bytes()[..]);
+        buffer.extend_from_slice(payload);
+    }
+    WitnessArgs::new_builder()
+        .lock(Some(buffer.freeze()).pack())
+        .build()
+        .as_bytes()
+}
+
+// Signature library exporting load_prefilled_data and validate_signature,
+// built from deps/ckb-miscellaneous-scripts by `make signature-library`.
+pub const SIGNATURE_LIBRARY: &str = "secp256k1_blake2b_sighash_all_dual";
+
+pub fn signature_library() -> Bytes {
+    Loader::default().load_binary(SIGNATURE_LIBRARY)
+}
+
+pub fn signature_library_hash() -> Bytes {
+    CellOutput::calc_data_hash(&signature_library()).as_bytes()
+}
+
+fn ckb_blake2b(data: &[u8]) -> Bytes {
+    let mut blake2b = Blake2bBuilder::new(32)
+        .personal(b"ckb-default-hash")
+        .build();
+    blake2b.update(data);
+    let mut hash = vec![0u8; 32];
+    blake2b.finalize(&mut hash[..]);
+    Bytes::from(hash)
+}
+
+// Identity of an aggregator using signatures: blake160 of its compressed
+// public key.
+pub fn signature_identity(privkey: &Privkey) -> Bytes {
+    let pubkey = privkey.pubkey().expect("pubkey");
+    ckb_blake2b(&pubkey.serialize()).slice(0..20)
+}
+
+// Message signed by aggregators for a PoA witness made of entries, see
+// calculate_signing_message in c/poa.c.
+pub fn signing_message(tx: &TransactionView, entries: &[(u8, Bytes)]) -> H256 {
+    let mut sorted_entries: Vec<&(u8, Bytes)> = entries
+        .iter()
+        .filter(|(tag, _)| *tag != 4 && *tag != 5)
+        .collect();
+    sorted_entries.sort_by_key(|(tag, _)| *tag);
+    let mut buffer = BytesMut::new();
+    buffer.extend_from_slice(&tx.hash().raw_data());
+    for (tag, payload) in sorted_entries {
+        buffer.extend_from_slice(&[*tag]);
+        buffer.extend_from_slice(&(payload.len() as u16).to_le_bytes()[..]);
+        buffer.extend_from_slice(payload);
+    }
+    let mut message = [0u8; 32];
+    message.copy_from_slice(&ckb_blake2b(&buffer));
+    H256::from(message)
+}
+
+pub fn sign_message(privkey: &Privkey, message: &H256) -> Bytes {
+    Bytes::from(privkey.sign_recoverable(message).expect("sign").serialize())
+}
+
+// Replaces the witness at witness_index with a PoA witness of entries,
+// followed by a signature entry with tag signature_tag built from the signing
+// message. The message covers the transaction hash, which does not depend on
+// witnesses, so signing happens after the transaction is built.
+pub fn sign_poa_transaction<F: FnOnce(&H256) -> Bytes>(
+    tx: TransactionView,
+    witness_index: usize,
+    entries: &[(u8, Bytes)],
+    signature_tag: u8,
+    sign: F,
+) -> TransactionView {
+    let signature = sign(&signing_message(&tx, entries));
+    let mut entries = entries.to_vec();
+    entries.push((signature_tag, signature));
+    let mut witnesses: Vec<Bytes> = tx
+        .witnesses()
+        .into_iter()
+        .map(|witness| witness.raw_data())
+        .collect();
+    witnesses[witness_index] = build_poa_witness(&entries);
+    tx.as_advanced_builder()
+        .set_witnesses(
+            witnesses
+                .into_iter()
+                .map(|witness| witness.pack())
+                .collect(),
+        )
+        .build()
+}
+
+pub fn serialize_uint32s(values: &[u32]) -> Bytes {
+    let mut buffer = BytesMut::new();
+    for value in values {
+        buffer.extend_from_slice(&value.to_le_bytes()[..]);
+    }
+    buffer.freeze()
+}
+
+pub fn serialize_uint64s(values: &[u64]) -> Bytes {
+    let mut buffer = BytesMut::new();
+    for value in values {
+        buffer.extend_from_slice(&value.to_le_bytes()[..]);
+    }
+    buffer.freeze()
+}
+
+// Builds the same new round transaction as test_poa_normal_update, with
+// witness attached to the PoA cell.
+fn build_normal_update_transaction(witness: Bytes) -> (Context, TransactionView) {
+    build_subblock_transaction(
+        subblock_setup(1),
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        witness,
+    )
+}
+
+// Setup used by build_subblock_transaction, identities are filled there
+// unless given.
+fn subblock_setup(subblocks_per_round: u32) -> PoASetup {
+    PoASetup {
+        identity_size: 32,
+        round_interval_uses_seconds: true,
+        aggregator_change_threshold: 2,
+        round_intervals: 90,
+        subblocks_per_round,
+        ..Default::default()
+    }
+}
+
+// Builds a normal mode transaction moving each PoA data cell from last data
+// to current data, all of them share one PoA setup cell and one PoA lock. The
+// PoA setup cell is cell dep 0, PoA data cells are inputs 1..=n and outputs
+// 1..=n, with one PoA cell per data cell, the owner input belongs to
+// aggregator 1. With signature identities, the signature library is deployed
+// and added to cell deps.
+fn build_subblock_transaction(
+    setup: PoASetup,
+    transitions: &[(PoAData, PoAData)],
+    witness: Bytes,
+) -> (Context, TransactionView) {
+    build_subblock_transaction_with_witness(setup, transitions, |_| witness)
+}
+
+// Same as build_subblock_transaction, but the witness is built from the final
+// PoA setup with identities filled.
+fn build_subblock_transaction_with_witness<F: FnOnce(&PoASetup) -> Bytes>(
+    setup: PoASetup,
+    transitions: &[(PoAData, PoAData)],
+    build_witness: F,
+) -> (Context, TransactionView) {
+    build_subblock_transaction_with_binaries("poa.strip", None, setup, transitions, build_witness)
+}
+
+// Same as build_subblock_transaction_with_witness, but the PoA lock runs
+// poa_binary, and PoA data cells are guarded by state_binary as state lock
+// instead of an always success lock when given. The binary is deployed once
+// when both are the same.
+fn build_subblock_transaction_with_binaries<F: FnOnce(&PoASetup) -> Bytes>(
+    poa_binary: &str,
+    state_binary: Option<&str>,
+    setup: PoASetup,
+    transitions: &[(PoAData, PoAData)],
+    build_witness: F,
+) -> (Context, TransactionView) {
+    // deploy contract
+    let mut context = Context::default();
+    let poa_bin: Bytes = Loader::default().load_binary(poa_binary);
+    let poa_out_point = context.deploy_cell(poa_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    // prepare scripts
+    let poa_owner_script1 = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let poa_owner_script2 = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let simple_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let poa_data_type_id_scripts: Vec<Script> = transitions
+        .iter()
+        .map(|_| {
+            Script::new_builder()
+                .code_hash(h256!("0x545950455f4944").pack())
+                .hash_type(ScriptHashType::Type.into())
+                .args(random_32bytes().pack())
+                .build()
+        })
+        .collect();
+    let poa_setup_type_id_args = random_32bytes();
+    let poa_setup_type_id_script = Script::new_builder()
+        .code_hash(h256!("0x545950455f4944").pack())
+        .hash_type(ScriptHashType::Type.into())
+        .args(poa_setup_type_id_args.pack())
+        .build();
+    let poa_lock_data = {
+        let mut buffer = BytesMut::new();
+        buffer.extend_from_slice(&poa_setup_type_id_args);
+        for script in &poa_data_type_id_scripts {
+            buffer.extend_from_slice(&script.args().raw_data());
+        }
+        buffer.freeze()
+    };
+    let poa_lock_script = context
+        .build_script(&poa_out_point, poa_lock_data)
+        .expect("build script");
+    let mut extra_deps = vec![];
+    let data_lock_script = match state_binary {
+        Some(name) => {
+            let state_out_point = if name == poa_binary {
+                poa_out_point.clone()
+            } else {
+                let out_point = context.deploy_cell(Loader::default().load_binary(name));
+                extra_deps.push(CellDep::new_builder().out_point(out_point.clone()).build());
+                out_point
+            };
+            context
+                .build_script(
+                    &state_out_point,
+                    poa_lock_script.calc_script_hash().as_bytes(),
+                )
+                .expect("build script")
+        }
+        None => simple_lock_script.clone(),
+    };
+    let poa_script_dep = CellDep::new_builder()
+        .out_point(poa_out_point.clone())
+        .build();
+    let always_success_script_dep = CellDep::new_builder()
+        .out_point(always_success_out_point.clone())
+        .build();
+
+    // Signature identities come with keys from the caller
+    if setup.signature_code_hash.is_some() {
+        let signature_out_point = context.deploy_cell(signature_library());
+        extra_deps.push(
+            CellDep::new_builder()
+                .out_point(signature_out_point)
+                .build(),
+        );
+    }
+
+    // prepare cells
+    let setup = if setup.identities.is_empty() {
+        PoASetup {
+            identities: vec![
+                poa_owner_script1.calc_script_hash().as_bytes(),
+                poa_owner_script2.calc_script_hash().as_bytes(),
+            ],
+            ..setup
+        }
+    } else {
+        setup
+    };
+    let witness = build_witness(&setup);
+    let poa_setup_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(simple_lock_script.clone())
+            .type_(
+                ScriptOpt::new_builder()
+                    .set(Some(poa_setup_type_id_script.clone()))
+                    .build(),
+            )
+            .build(),
+        serialize_poa_setup(&setup),
+    );
+    let poa_setup_dep = CellDep::new_builder()
+        .out_point(poa_setup_out_point.clone())
+        .build();
+
+    let owner_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(500u64.pack())
+            .lock(poa_owner_script2.clone())
+            .build(),
+        Bytes::new(),
+    );
+    let owner_input = CellInput::new_builder()
+        .previous_output(owner_input_out_point)
+        .build();
+    let since_flags = if setup.round_interval_uses_seconds {
+        0x4000000000000000u64
+    } else {
+        0
+    };
+    let mut poa_inputs = vec![];
+    let mut poa_data_inputs = vec![];
+    let mut poa_outputs = vec![];
+    let mut poa_data_outputs = vec![];
+    let mut poa_outputs_data = vec![];
+    let mut poa_data_outputs_data = vec![];
+    for ((last_data, current_data), poa_data_type_id_script) in
+        transitions.iter().zip(poa_data_type_id_scripts.iter())
+    {
+        let poa_input_out_point = context.create_cell(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(poa_lock_script.clone())
+                .build(),
+            Bytes::from_static(b"old"),
+        );
+        poa_inputs.push(
+            CellInput::new_builder()
+                .previous_output(poa_input_out_point)
+                .since((since_flags | current_data.subblock_subtime).pack())
+                .build(),
+        );
+        let poa_data_input_out_point = context.create_cell(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(data_lock_script.clone())
+                .type_(
+                    ScriptOpt::new_builder()
+                        .set(Some(poa_data_type_id_script.clone()))
+                        .build(),
+                )
+                .build(),
+            serialize_poa_data(last_data),
+        );
+        poa_data_inputs.push(
+            CellInput::new_builder()
+                .previous_output(poa_data_input_out_point)
+                .build(),
+        );
+        poa_outputs.push(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(poa_lock_script.clone())
+                .build(),
+        );
+        poa_outputs_data.push(Bytes::from_static(b"new"));
+        poa_data_outputs.push(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(data_lock_script.clone())
+                .type_(
+                    ScriptOpt::new_builder()
+                        .set(Some(poa_data_type_id_script.clone()))
+                        .build(),
+                )
+                .build(),
+        );
+        poa_data_outputs_data.push(serialize_poa_data(current_data));
+    }
+    let poa_input = poa_inputs.remove(0);
+    let poa_output = poa_outputs.remove(0);
+    let poa_output_data = poa_outputs_data.remove(0);
+
+    // build transaction
+    let tx = TransactionBuilder::default()
+        .input(poa_input)
+        .inputs(poa_data_inputs)
+        .inputs(poa_inputs)
+        .input(owner_input)
+        .output(poa_output)
+        .outputs(poa_data_outputs)
+        .outputs(poa_outputs)
+        .output_data(poa_output_data.pack())
+        .outputs_data(poa_data_outputs_data.pack())
+        .outputs_data(poa_outputs_data.pack())
+        .cell_dep(poa_setup_dep)
+        .cell_dep(poa_script_dep)
+        .cell_dep(always_success_script_dep)
+        .cell_deps(extra_deps)
+        .witness(witness.pack())
+        .build();
+    let tx = context.complete_tx(tx);
+    (context, tx)
+}
+
+#[test]
+fn test_poa_normal_update_with_hints() {
+    let (context, tx) =
+        build_normal_update_transaction(build_poa_witness(&[(1, serialize_uint32s(&[0, 1, 1]))]));
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_normal_update_with_hints",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_normal_update_with_large_witness() {
+    // Other scripts can keep large payloads in input_type of the same
+    // witness, only the lock field is loaded by the PoA lock.
+    let mut lock = BytesMut::new();
+    lock.extend_from_slice(&[1, 12, 0]);
+    lock.extend_from_slice(&serialize_uint32s(&[0, 1, 1]));
+    let witness = WitnessArgs::new_builder()
+        .lock(Some(lock.freeze()).pack())
+        .input_type(Some(Bytes::from(vec![0u8; 65536])).pack())
+        .build()
+        .as_bytes();
+    let (context, tx) = build_normal_update_transaction(witness);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_normal_update_with_large_witness",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_invalid_hints_failure() {
+    // Cell dep 1 is the PoA script itself, not the PoA setup cell.
+    let (context, tx) =
+        build_normal_update_transaction(build_poa_witness(&[(1, serialize_uint32s(&[1, 1, 1]))]));
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_invalid_hints_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_subblock_batch() {
+    // Subblocks 1, 2 and 3 are committed at once.
+    let (context, tx) = build_subblock_transaction(
+        subblock_setup(4),
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1050,
+                aggregator_index: 1,
+                subblock_index: 3,
+            },
+        )],
+        build_poa_witness(&[(3, serialize_uint64s(&[1010, 1020, 1050]))]),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_subblock_batch",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_subblock_batch_index_mismatch_failure() {
+    // Batch only contains 2 subblocks, while subblock index advances by 3.
+    let (context, tx) = build_subblock_transaction(
+        subblock_setup(4),
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1050,
+                aggregator_index: 1,
+                subblock_index: 3,
+            },
+        )],
+        build_poa_witness(&[(3, serialize_uint64s(&[1020, 1050]))]),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_subblock_batch_index_mismatch_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_multiple_data_cells() {
+    // Two rollups sharing the same committee issue subblocks together, one of
+    // them starts a new round while the other stays in current round.
+    let (context, tx) = build_subblock_transaction(
+        subblock_setup(4),
+        &[
+            (
+                PoAData {
+                    round_initial_subtime: 1000,
+                    subblock_subtime: 1000,
+                    aggregator_index: 0,
+                    subblock_index: 0,
+                },
+                PoAData {
+                    round_initial_subtime: 1100,
+                    subblock_subtime: 1100,
+                    aggregator_index: 1,
+                    subblock_index: 0,
+                },
+            ),
+            (
+                PoAData {
+                    round_initial_subtime: 1050,
+                    subblock_subtime: 1060,
+                    aggregator_index: 1,
+                    subblock_index: 1,
+                },
+                PoAData {
+                    round_initial_subtime: 1050,
+                    subblock_subtime: 1100,
+                    aggregator_index: 1,
+                    subblock_index: 2,
+                },
+            ),
+        ],
+        build_poa_witness(&[(1, serialize_uint32s(&[0, 1, 1, 2, 2]))]),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_multiple_data_cells",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_signature_identity_missing_signature_failure() {
+    // Owner input cell cannot authorize aggregators with signature identities.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            identity_size: 20,
+            signature_code_hash: Some(random_32bytes()),
+            ..subblock_setup(1)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_signature_identity_missing_signature_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+// Setup and transition where aggregator 1 takes over from aggregator 0, with
+// identities derived from keys.
+fn signature_subblock_setup(keys: &[Privkey]) -> PoASetup {
+    PoASetup {
+        identity_size: 20,
+        identities: keys.iter().map(signature_identity).collect(),
+        signature_code_hash: Some(signature_library_hash()),
+        ..subblock_setup(1)
+    }
+}
+
+fn new_round_transition() -> (PoAData, PoAData) {
+    (
+        PoAData {
+            round_initial_subtime: 1000,
+            subblock_subtime: 1000,
+            aggregator_index: 0,
+            subblock_index: 0,
+        },
+        PoAData {
+            round_initial_subtime: 1100,
+            subblock_subtime: 1100,
+            aggregator_index: 1,
+            subblock_index: 0,
+        },
+    )
+}
+
+#[test]
+fn test_poa_signature_identity() {
+    let keys = vec![Generator::random_privkey(), Generator::random_privkey()];
+    let (context, tx) = build_subblock_transaction(
+        signature_subblock_setup(&keys),
+        &[new_round_transition()],
+        Bytes::new(),
+    );
+    let tx = sign_poa_transaction(tx, 0, &[], 4, |message| sign_message(&keys[1], message));
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // Same subblock authorized by an owner cell, for comparison
+    let (owner_context, owner_tx) =
+        build_subblock_transaction(subblock_setup(1), &[new_round_transition()], Bytes::new());
+    let owner_cycles = owner_context
+        .verify_tx(&owner_tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!(
+        "signature: {} cycles, {} bytes; owner cell: {} cycles, {} bytes",
+        cycles,
+        tx.data().as_slice().len(),
+        owner_cycles,
+        owner_tx.data().as_slice().len()
+    );
+    // Not dumped for the simulator, which would need a native build of the
+    // signature library.
+}
+
+#[test]
+fn test_poa_signature_identity_wrong_signer_failure() {
+    // Signed by a key outside of the setup, the owner input of aggregator 1
+    // does not help either.
+    let keys = vec![Generator::random_privkey(), Generator::random_privkey()];
+    let (context, tx) = build_subblock_transaction(
+        signature_subblock_setup(&keys),
+        &[new_round_transition()],
+        Bytes::new(),
+    );
+    let tx = sign_poa_transaction(tx, 0, &[], 4, |message| {
+        sign_message(&Generator::random_privkey(), message)
+    });
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+    // Not dumped for the simulator, see test_poa_signature_identity.
+}
+
+// Builds a setup update approved by keys at the given aggregator indices,
+// signer_keys lists the key actually signing for each approval.
+fn build_multisig_setup_update_transaction(
+    keys: &[Privkey],
+    threshold: u8,
+    approvals: &[usize],
+    signer_keys: &[&Privkey],
+) -> (Context, TransactionView) {
+    let (context, tx) = build_setup_update_transaction_with_witness(
+        keys.len(),
+        |_| (),
+        PoASetup {
+            identity_size: 20,
+            identities: keys.iter().map(signature_identity).collect(),
+            aggregator_change_threshold: threshold,
+            signature_code_hash: Some(signature_library_hash()),
+            ..Default::default()
+        },
+        &[],
+        |_| Bytes::new(),
+    );
+    let tx = sign_poa_transaction(tx, 1, &[], 5, |message| {
+        let mut multisig = BytesMut::new();
+        let mut bitmap = vec![0u8; (keys.len() + 7) / 8];
+        for index in approvals {
+            bitmap[index / 8] |= 1 << (index % 8);
+        }
+        multisig.extend_from_slice(&bitmap);
+        for key in signer_keys {
+            multisig.extend_from_slice(&sign_message(key, message));
+        }
+        multisig.freeze()
+    });
+    (context, tx)
+}
+
+#[test]
+fn test_poa_setup_update_multisig() {
+    let keys: Vec<Privkey> = (0..5).map(|_| Generator::random_privkey()).collect();
+    let (context, tx) = build_multisig_setup_update_transaction(
+        &keys,
+        3,
+        &[0, 2, 4],
+        &[&keys[0], &keys[2], &keys[4]],
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+    // Not dumped for the simulator, see test_poa_signature_identity.
+}
+
+#[test]
+fn test_poa_setup_update_multisig_duplicate_signer_failure() {
+    // Aggregator 0 signs twice, once in place of aggregator 2.
+    let keys: Vec<Privkey> = (0..5).map(|_| Generator::random_privkey()).collect();
+    let (context, tx) = build_multisig_setup_update_transaction(
+        &keys,
+        3,
+        &[0, 2, 4],
+        &[&keys[0], &keys[0], &keys[4]],
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+#[test]
+fn test_poa_setup_update_multisig_outside_signer_failure() {
+    // The last approval is signed by a key outside of the setup.
+    let keys: Vec<Privkey> = (0..5).map(|_| Generator::random_privkey()).collect();
+    let outsider = Generator::random_privkey();
+    let (context, tx) = build_multisig_setup_update_transaction(
+        &keys,
+        3,
+        &[0, 2, 4],
+        &[&keys[0], &keys[2], &outsider],
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+#[test]
+fn test_poa_setup_update_multisig_missing_approvals_failure() {
+    // Owner cells cannot approve setups with signature identities, the
+    // bitmap approves only 1 aggregator while 2 are required.
+    let mut multisig = vec![0b00000100u8];
+    multisig.extend_from_slice(&[0u8; 130]);
+    let (context, tx) = build_setup_update_transaction_with_witness(
+        5,
+        |_| (),
+        PoASetup {
+            identity_size: 20,
+            aggregator_change_threshold: 2,
+            signature_code_hash: Some(random_32bytes()),
+            ..Default::default()
+        },
+        &[0, 1],
+        |_| build_poa_witness(&[(5, Bytes::from(multisig))]),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_multisig_missing_approvals_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_merkle_identities() {
+    let (context, tx) = build_subblock_transaction_with_witness(
+        PoASetup {
+            merkle_identities: true,
+            ..subblock_setup(1)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        |setup| build_poa_witness(&[(6, build_merkle_proof(setup, 1))]),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_merkle_identities",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_merkle_identities_wrong_proof_failure() {
+    // Proof of aggregator 0 cannot be used by aggregator 1.
+    let (context, tx) = build_subblock_transaction_with_witness(
+        PoASetup {
+            merkle_identities: true,
+            ..subblock_setup(1)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1000,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        |setup| {
+            let mut proof = build_merkle_proof(setup, 0).to_vec();
+            proof[0] = 1;
+            build_poa_witness(&[(6, Bytes::from(proof))])
+        },
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_merkle_identities_wrong_proof_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_setup_update_merkle_identities() {
+    let (context, tx) = build_setup_update_transaction_with_witness(
+        5,
+        |_| (),
+        PoASetup {
+            identity_size: 32,
+            aggregator_change_threshold: 3,
+            merkle_identities: true,
+            ..Default::default()
+        },
+        &[4, 0, 2],
+        |setup| {
+            let mut proofs = BytesMut::new();
+            for index in &[0, 2, 4] {
+                proofs.extend_from_slice(&build_merkle_proof(setup, *index));
+            }
+            build_poa_witness(&[(6, proofs.freeze())])
+        },
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_merkle_identities",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_setup_update_merkle_duplicate_identity_failure() {
+    // Aggregators 0 and 2 share one identity, a single owner cell cannot
+    // approve for both of them.
+    let (context, tx) = build_setup_update_transaction_with_witness(
+        5,
+        |owners| owners[2] = owners[0].clone(),
+        PoASetup {
+            identity_size: 32,
+            aggregator_change_threshold: 2,
+            merkle_identities: true,
+            ..Default::default()
+        },
+        &[0],
+        |setup| {
+            let mut proofs = BytesMut::new();
+            for index in &[0, 2] {
+                proofs.extend_from_slice(&build_merkle_proof(setup, *index));
+            }
+            build_poa_witness(&[(6, proofs.freeze())])
+        },
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_merkle_duplicate_identity_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_setup_update_merkle_threshold_too_large_failure() {
+    // 150 proofs of 290 bytes each cannot fit in the PoA witness, such a
+    // setup could never be updated again.
+    let (context, tx) = build_setup_update_transaction_with_witness(
+        200,
+        |_| (),
+        PoASetup {
+            identity_size: 32,
+            aggregator_change_threshold: 150,
+            merkle_identities: true,
+            ..Default::default()
+        },
+        &[],
+        |_| Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 1,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_setup_update_merkle_threshold_too_large_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_early_handoff() {
+    // Aggregator 0 used up its 2 subblocks, aggregator 1 takes over before
+    // round_intervals pass.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            early_handoff: true,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1010,
+                subblock_subtime: 1010,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_early_handoff",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_early_handoff_disabled_failure() {
+    let (context, tx) = build_subblock_transaction(
+        subblock_setup(2),
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1010,
+                subblock_subtime: 1010,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_early_handoff_disabled_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_lanes() {
+    // With 2 lanes, aggregator 1 is the only one in its lane, so it can start
+    // a new round once round_intervals pass, instead of waiting for
+    // aggregator 0.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            lane_count: 2,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 1,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup("poa_lanes", "poa_sim", &tx, &context, &setup, 0, true);
+}
+
+#[test]
+fn test_poa_lanes_wrong_lane_failure() {
+    // Aggregator 1 cannot advance the PoA data cell of aggregator 0's lane.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            lane_count: 2,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1100,
+                subblock_subtime: 1100,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_lanes_wrong_lane_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_overlap_window() {
+    // Round of aggregator 0 ends at 1090, aggregator 1 opens its round once
+    // the 20 second overlap window starts.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            overlap_window: 20,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1075,
+                subblock_subtime: 1075,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_overlap_window",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_overlap_window_quota_failure() {
+    // Aggregator 1 already committed a subblock in the overlap window, which
+    // closes its round.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            overlap_window: 20,
+            ..subblock_setup(4)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1075,
+                aggregator_index: 1,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1080,
+                aggregator_index: 1,
+                subblock_index: 2,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_overlap_window_quota_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+// Adds a header dep with header_subtime as timestamp to a transaction built by
+// build_subblock_transaction, and lets the PoA cell use since instead of the
+// subtime.
+fn use_header_time(
+    context: &mut Context,
+    tx: TransactionView,
+    header_subtime: u64,
+    since: u64,
+) -> TransactionView {
+    let header = HeaderBuilder::default()
+        .timestamp((header_subtime * 1000).pack())
+        .build();
+    let header_hash = header.hash();
+    context.insert_header(header);
+    let mut inputs: Vec<CellInput> = tx.inputs().into_iter().collect();
+    inputs[0] = inputs[0]
+        .clone()
+        .as_builder()
+        .since((0x4000000000000000u64 | since).pack())
+        .build();
+    tx.as_advanced_builder()
+        .set_inputs(inputs)
+        .header_dep(header_hash)
+        .build()
+}
+
+#[test]
+fn test_poa_header_time() {
+    // Median time still lags at 1000, the header dep already reaches 1090.
+    let (mut context, tx) = build_subblock_transaction(
+        PoASetup {
+            max_header_age: Some(120),
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1090,
+                subblock_subtime: 1090,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+    let tx = use_header_time(&mut context, tx, 1090, 1000);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup("poa_header_time", "poa_sim", &tx, &context, &setup, 0, true);
+}
+
+#[test]
+fn test_poa_header_time_too_old_failure() {
+    // since trails the header dep by more than max_header_age.
+    let (mut context, tx) = build_subblock_transaction(
+        PoASetup {
+            max_header_age: Some(120),
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 0,
+            },
+            PoAData {
+                round_initial_subtime: 1090,
+                subblock_subtime: 1090,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+    let tx = use_header_time(&mut context, tx, 1090, 900);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_header_time_too_old_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_block_intervals() {
+    // Round of aggregator 0 starts at block 1000 and lasts 90 blocks.
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            round_interval_uses_seconds: false,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1090,
+                subblock_subtime: 1090,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_block_intervals",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_poa_block_intervals_early_failure() {
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            round_interval_uses_seconds: false,
+            ..subblock_setup(2)
+        },
+        &[(
+            PoAData {
+                round_initial_subtime: 1000,
+                subblock_subtime: 1005,
+                aggregator_index: 0,
+                subblock_index: 1,
+            },
+            PoAData {
+                round_initial_subtime: 1089,
+                subblock_subtime: 1089,
+                aggregator_index: 1,
+                subblock_index: 0,
+            },
+        )],
+        Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "poa_block_intervals_early_failure",
+        "poa_sim",
+        &tx,
+        &context,
+        &setup,
+        -2,
+        true,
+    );
+}
+
+// Builds a transaction where the PoA cell is guarded by the dual caller, which
+// validates the transition from last_data to current_data by loading the dual
+// build of PoA lock. Aggregator 1 provides the owner input.
+fn build_dual_transaction(
+    last_data: &PoAData,
+    current_data: &PoAData,
+) -> (Context, TransactionView) {
+    // deploy contract
+    let mut context = Context::default();
+    let dual_bin: Bytes = Loader::default().load_binary("poa_dual.strip");
+    let dual_hash = CellOutput::calc_data_hash(&dual_bin).as_bytes();
+    let dual_out_point = context.deploy_cell(dual_bin);
+    let caller_bin: Bytes = Loader::default().load_binary("poa_dual_caller.strip");
+    let caller_out_point = context.deploy_cell(caller_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    // prepare scripts
+    let owner_scripts: Vec<Script> = (0..2)
+        .map(|_| {
+            context
+                .build_script(&always_success_out_point, random_32bytes())
+                .expect("build script")
+        })
+        .collect();
+    let simple_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let caller_lock_script = context
+        .build_script(&caller_out_point, dual_hash)
+        .expect("build script");
+
+    // prepare cells
+    let setup = PoASetup {
+        identities: owner_scripts
+            .iter()
+            .map(|script| script.calc_script_hash().as_bytes())
+            .collect(),
+        ..subblock_setup(1)
+    };
+    let poa_setup_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(simple_lock_script.clone())
+            .build(),
+        serialize_poa_setup(&setup),
+    );
+    let poa_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(caller_lock_script.clone())
+            .build(),
+        Bytes::new(),
+    );
+    let poa_data_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(1000u64.pack())
+            .lock(simple_lock_script.clone())
+            .build(),
+        serialize_poa_data(last_data),
+    );
+    let owner_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(500u64.pack())
+            .lock(owner_scripts[1].clone())
+            .build(),
+        Bytes::new(),
+    );
+
+    // build transaction
+    let tx = TransactionBuilder::default()
+        .input(
+            CellInput::new_builder()
+                .previous_output(poa_input_out_point)
+                .since((0x4000000000000000u64 | current_data.subblock_subtime).pack())
+                .build(),
+        )
+        .input(
+            CellInput::new_builder()
+                .previous_output(poa_data_input_out_point)
+                .build(),
+        )
+        .input(
+            CellInput::new_builder()
+                .previous_output(owner_input_out_point)
+                .build(),
+        )
+        .output(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(caller_lock_script)
+                .build(),
+        )
+        .output(
+            CellOutput::new_builder()
+                .capacity(1000u64.pack())
+                .lock(simple_lock_script)
+                .build(),
+        )
+        .output_data(Bytes::new().pack())
+        .output_data(serialize_poa_data(current_data).pack())
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(poa_setup_out_point)
+                .build(),
+        )
+        .cell_dep(CellDep::new_builder().out_point(dual_out_point).build())
+        .cell_dep(CellDep::new_builder().out_point(caller_out_point).build())
+        .cell_dep(
+            CellDep::new_builder()
+                .out_point(always_success_out_point)
+                .build(),
+        )
+        .build();
+    let tx = context.complete_tx(tx);
+    (context, tx)
+}
+
+#[test]
+fn test_poa_dual() {
+    let (last_data, current_data) = new_round_transition();
+    let (context, tx) = build_dual_transaction(&last_data, &current_data);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // Same subblock validated by the standalone PoA lock
+    let (standalone_context, standalone_tx) = build_subblock_transaction_with_binaries(
+        "poa.strip",
+        None,
+        subblock_setup(1),
+        &[(last_data, current_data)],
+        |_| Bytes::new(),
+    );
+    let standalone_cycles = standalone_context
+        .verify_tx(&standalone_tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!(
+        "dual: {} cycles, standalone: {} cycles",
+        cycles, standalone_cycles
+    );
+    // Not dumped for the simulator, which would need a native build of the
+    // dual build to load.
+}
+
+#[test]
+fn test_poa_dual_wrong_aggregator_failure() {
+    // Aggregator 0 cannot take another round, the owner input belongs to
+    // aggregator 1.
+    let (last_data, mut current_data) = new_round_transition();
+    current_data.aggregator_index = 0;
+    let (context, tx) = build_dual_transaction(&last_data, &current_data);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+#[test]
+fn test_poa_state_combined() {
+    // poa_state runs as both the PoA lock and the state lock of the PoA data
+    // cell, from a single cell dep.
+    let (context, tx) = build_subblock_transaction_with_binaries(
+        "poa_state.strip",
+        Some("poa_state.strip"),
+        subblock_setup(1),
+        &[new_round_transition()],
+        |_| Bytes::new(),
+    );
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // Same subblock with separate PoA lock and state lock binaries
+    let (separate_context, separate_tx) = build_subblock_transaction_with_binaries(
+        "poa.strip",
+        Some("state.strip"),
+        subblock_setup(1),
+        &[new_round_transition()],
+        |_| Bytes::new(),
+    );
+    let separate_cycles = separate_context
+        .verify_tx(&separate_tx, MAX_CYCLES)
+        .expect("pass verification");
+    let loader = Loader::default();
+    println!(
+        "combined: {} cycles, {} bytes tx, {} bytes binary; separate: {} cycles, {} bytes tx, {} + {} bytes binaries",
+        cycles,
+        tx.data().as_slice().len(),
+        loader.load_binary("poa_state.strip").len(),
+        separate_cycles,
+        separate_tx.data().as_slice().len(),
+        loader.load_binary("poa.strip").len(),
+        loader.load_binary("state.strip").len()
+    );
+    // Not dumped for the simulator, poa_sim is built without the state lock.
+}
+
+#[test]
+fn test_poa_state_combined_wrong_aggregator_failure() {
+    // The PoA role still validates subblocks, aggregator 0 cannot take
+    // another round.
+    let (last_data, mut current_data) = new_round_transition();
+    current_data.aggregator_index = 0;
+    let (context, tx) = build_subblock_transaction_with_binaries(
+        "poa_state.strip",
+        Some("poa_state.strip"),
+        subblock_setup(1),
+        &[(last_data, current_data)],
+        |_| Bytes::new(),
+    );
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+// Setup update on the specialized build for 32 byte identities and 21
+// aggregators, see `make specialized`.
+fn build_specialized_setup_update_transaction(owner_count: usize) -> (Context, TransactionView) {
+    build_setup_update_transaction_with_binary(
+        "poa_32_21.strip",
+        owner_count,
+        |_| (),
+        PoASetup {
+            identity_size: 32,
+            aggregator_change_threshold: 11,
+            ..Default::default()
+        },
+        &[20, 0, 3, 7, 9, 11, 12, 15, 16, 18, 19],
+        |_| Bytes::new(),
+    )
+}
+
+#[test]
+fn test_poa_specialized() {
+    let (context, tx) = build_specialized_setup_update_transaction(21);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // Same update on the generic build
+    let (generic_context, generic_tx) = build_setup_update_transaction(
+        21,
+        |_| (),
+        false,
+        11,
+        &[20, 0, 3, 7, 9, 11, 12, 15, 16, 18, 19],
+    );
+    let generic_cycles = generic_context
+        .verify_tx(&generic_tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!(
+        "specialized: {} cycles; generic: {} cycles",
+        cycles, generic_cycles
+    );
+    // Not dumped for the simulator, poa_sim is built without fixed shapes.
+}
+
+#[test]
+fn test_poa_specialized_mismatched_setup_failure() {
+    // 22 aggregators do not fit the build for 21.
+    let (context, tx) = build_specialized_setup_update_transaction(22);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+// Parses a hex string written by the TypeScript generator tests.
+fn decode_hex(hex: &str) -> Bytes {
+    let hex = hex.trim_start_matches("0x");
+    (0..hex.len())
+        .step_by(2)
+        .map(|i| u8::from_str_radix(&hex[i..i + 2], 16).expect("hex"))
+        .collect::<Vec<u8>>()
+        .into()
+}
+
+fn parse_generator_poa_data(value: &serde_json::Value) -> PoAData {
+    PoAData {
+        round_initial_subtime: value["round_initial_subtime"].as_u64().expect("u64"),
+        subblock_subtime: value["subblock_subtime"].as_u64().expect("u64"),
+        aggregator_index: value["aggregator_index"].as_u64().expect("u64") as u16,
+        subblock_index: value["subblock_index"].as_u64().expect("u32") as u32,
+    }
+}
+
+// Verifies the subblock issued by aggregator 1 in tests/ts/generator_test.ts:
+// the PoA data transition, since of the PoA cell and PoA witness are all taken
+// from build/generator_tests/<name>.json. Those tests are ignored by default,
+// `make test-generator` runs them after the TypeScript tests.
+fn verify_generator_fixture(name: &str) {
+    let mut path = std::env::current_dir().unwrap();
+    path.push("..");
+    path.push("build");
+    path.push("generator_tests");
+    path.push(format!("{}.json", name));
+    let content = std::fs::read_to_string(&path).expect("run `yarn test` first");
+    let fixture: serde_json::Value = serde_json::from_str(&content).expect("json");
+    let setup = &fixture["setup"];
+    let (context, tx) = build_subblock_transaction(
+        PoASetup {
+            round_interval_uses_seconds: setup["round_interval_uses_seconds"]
+                .as_bool()
+                .expect("bool"),
+            round_intervals: setup["round_intervals"].as_u64().expect("u32") as u32,
+            early_handoff: setup["early_handoff"].as_bool().expect("bool"),
+            overlap_window: setup["overlap_window"].as_u64().expect("u32") as u32,
+            ..subblock_setup(setup["subblocks_per_round"].as_u64().expect("u32") as u32)
+        },
+        &[(
+            parse_generator_poa_data(&fixture["last_data"]),
+            parse_generator_poa_data(&fixture["current_data"]),
+        )],
+        decode_hex(fixture["witness"].as_str().expect("witness")),
+    );
+    let since = u64::from_str_radix(
+        fixture["since"]
+            .as_str()
+            .expect("since")
+            .trim_start_matches("0x"),
+        16,
+    )
+    .expect("since");
+    let mut inputs: Vec<CellInput> = tx.inputs().into_iter().collect();
+    inputs[0] = inputs[0].clone().as_builder().since(since.pack()).build();
+    let tx = tx.as_advanced_builder().set_inputs(inputs).build();
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+}
+
+#[test]
+#[ignore]
+fn test_poa_generator_overlap_handoff() {
+    verify_generator_fixture("overlap_handoff");
+}
+
+#[test]
+#[ignore]
+fn test_poa_generator_block_intervals_handoff() {
+    verify_generator_fixture("block_intervals_handoff");
+}
+
+#[test]
+#[ignore]
+fn test_poa_generator_block_intervals_subblock() {
+    verify_generator_fixture("block_intervals_subblock");
+}
@@ -1,6 +1,11 @@
 use super::*;
 use ckb_testtool::{builtin::ALWAYS_SUCCESS, context::Context};
-use ckb_tool::ckb_types::{bytes::Bytes, core::TransactionBuilder, packed::*, prelude::*};
+use ckb_tool::ckb_types::{
+    bytes::Bytes,
+    core::{TransactionBuilder, TransactionView},
+    packed::*,
+    prelude::*,
+};
 use ckb_x64_simulator::RunningSetup;
 use std::collections::HashMap;
 
@@ -177,7 +182,7 @@ fn test_state_update_failure() {
         &tx,
         &context,
         &setup,
-        1,
+        -1,
         true,
     );
 }
@@ -273,3 +278,197 @@ fn test_state_invalid_args_failure() {
         true,
     );
 }
+
+// Builds a transaction unlocking a state cell at input 0, with the PoA cell
+// at input 1, and the state lock hint set to hint.
+fn build_hinted_state_transaction(hint: u32) -> (Context, TransactionView) {
+    build_hinted_state_transaction_with_binary("state.strip", hint)
+}
+
+// Same as build_hinted_state_transaction, but the state lock runs binary.
+fn build_hinted_state_transaction_with_binary(
+    binary: &str,
+    hint: u32,
+) -> (Context, TransactionView) {
+    // deploy contract
+    let mut context = Context::default();
+    let state_bin: Bytes = Loader::default().load_binary(binary);
+    let state_out_point = context.deploy_cell(state_bin);
+    let always_success_out_point = context.deploy_cell(ALWAYS_SUCCESS.clone());
+
+    // prepare scripts
+    let target_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+    let target_lock_script_dep = CellDep::new_builder()
+        .out_point(always_success_out_point.clone())
+        .build();
+    let state_lock_script = context
+        .build_script(
+            &state_out_point,
+            target_lock_script.calc_script_hash().as_bytes(),
+        )
+        .expect("build script");
+    let state_lock_dep = CellDep::new_builder()
+        .out_point(state_out_point.clone())
+        .build();
+    let output_lock_script = context
+        .build_script(&always_success_out_point, random_32bytes())
+        .expect("build script");
+
+    // prepare cells
+    let target_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(500u64.pack())
+            .lock(target_lock_script.clone())
+            .build(),
+        Bytes::new(),
+    );
+    let target_input = CellInput::new_builder()
+        .previous_output(target_input_out_point)
+        .build();
+    let state_input_out_point = context.create_cell(
+        CellOutput::new_builder()
+            .capacity(500u64.pack())
+            .lock(state_lock_script.clone())
+            .build(),
+        Bytes::new(),
+    );
+    let state_input = CellInput::new_builder()
+        .previous_output(state_input_out_point)
+        .build();
+    let outputs = vec![CellOutput::new_builder()
+        .capacity(1000u64.pack())
+        .lock(output_lock_script.clone())
+        .build()];
+    let outputs_data = vec![Bytes::new()];
+    let witness = WitnessArgs::new_builder()
+        .lock(Some(Bytes::from(hint.to_le_bytes().to_vec())).pack())
+        .build();
+
+    // build transaction
+    let tx = TransactionBuilder::default()
+        .input(state_input)
+        .input(target_input)
+        .outputs(outputs)
+        .outputs_data(outputs_data.pack())
+        .cell_dep(state_lock_dep)
+        .cell_dep(target_lock_script_dep)
+        .witness(witness.as_bytes().pack())
+        .build();
+    let tx = context.complete_tx(tx);
+    (context, tx)
+}
+
+#[test]
+fn test_state_hinted_unlock() {
+    let (context, tx) = build_hinted_state_transaction(1);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "state_hinted_unlock",
+        "state_sim",
+        &tx,
+        &context,
+        &setup,
+        0,
+        true,
+    );
+}
+
+#[test]
+fn test_state_wrong_hint_failure() {
+    let (context, tx) = build_hinted_state_transaction(0);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+
+    // dump raw test tx files
+    let setup = RunningSetup {
+        is_lock_script: true,
+        is_output: false,
+        script_index: 0,
+        native_binaries: HashMap::default(),
+    };
+    write_native_setup(
+        "state_wrong_hint_failure",
+        "state_sim",
+        &tx,
+        &context,
+        &setup,
+        -1,
+        true,
+    );
+}
+
+// Replaces the witness of build_hinted_state_transaction with one keeping a
+// large payload in input_type, next to the same hint in lock.
+fn with_large_witness(tx: TransactionView, hint: u32) -> TransactionView {
+    let witness = WitnessArgs::new_builder()
+        .lock(Some(Bytes::from(hint.to_le_bytes().to_vec())).pack())
+        .input_type(Some(Bytes::from(vec![7u8; 256])).pack())
+        .build();
+    tx.as_advanced_builder()
+        .set_witnesses(vec![witness.as_bytes().pack()])
+        .build()
+}
+
+#[test]
+fn test_state_hinted_unlock_with_large_witness() {
+    let (context, tx) = build_hinted_state_transaction(1);
+    let tx = with_large_witness(tx, 1);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+}
+
+#[test]
+fn test_state_wrong_hint_with_large_witness_failure() {
+    // The hint is still honored when the witness is large.
+    let (context, tx) = build_hinted_state_transaction(0);
+    let tx = with_large_witness(tx, 0);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
+
+#[test]
+fn test_poa_state_as_state_lock() {
+    // 32 byte args make poa_state act as the state lock.
+    let (context, tx) = build_hinted_state_transaction_with_binary("poa_state.strip", 1);
+
+    // run
+    let cycles = context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect("pass verification");
+    println!("consume cycles: {}", cycles);
+}
+
+#[test]
+fn test_poa_state_as_state_lock_wrong_hint_failure() {
+    let (context, tx) = build_hinted_state_transaction_with_binary("poa_state.strip", 0);
+
+    // run
+    context
+        .verify_tx(&tx, MAX_CYCLES)
+        .expect_err("fail verification");
+}
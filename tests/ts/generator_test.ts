@@ -0,0 +1,288 @@
+// Runs PoAGenerator against cells served by a fake indexer. Each test also
+// writes the PoA data transition, since and witness it produced to
+// build/generator_tests, where test_poa_generator_* in tests/src/poa_tests.rs
+// verify them with the PoA lock. Run via `make test-generator`.
+import { strict as assert } from "assert";
+import { mkdirSync, writeFileSync } from "fs";
+import { join } from "path";
+import { Reader } from "ckb-js-toolkit";
+import { utils, Cell, Header, Indexer, Script } from "@ckb-lumos/base";
+import { TransactionSkeleton, generateAddress } from "@ckb-lumos/helpers";
+import {
+  PoAData,
+  PoASetup,
+  parsePoAData,
+  serializePoAData,
+  serializePoASetup,
+} from "../../src/config";
+import { PoAGenerator } from "../../src/generator";
+
+const FIXTURE_DIR = join(__dirname, "..", "..", "..", "generator_tests");
+
+const TYPE_ID_CODE_HASH =
+  "0x00000000000000000000000000000000000000000000000000545950455f4944";
+const SETUP_TYPE_ID_ARGS = "0x" + "33".repeat(32);
+const DATA_TYPE_ID_ARGS = "0x" + "44".repeat(32);
+
+function aggregatorLock(aggregatorIndex: number): Script {
+  return {
+    code_hash: "0x" + "11".repeat(32),
+    hash_type: "type",
+    args: "0x0" + aggregatorIndex,
+  };
+}
+
+function typeIdCell(args: string, data: ArrayBuffer, index: number): Cell {
+  return {
+    cell_output: {
+      capacity: "0x100000000",
+      lock: aggregatorLock(0),
+      type: { code_hash: TYPE_ID_CODE_HASH, hash_type: "type", args },
+    },
+    data: new Reader(data).serializeJson(),
+    out_point: { tx_hash: "0x" + "55".repeat(32), index: "0x" + index },
+  };
+}
+
+// Serves PoA setup and PoA data cells by their type ID args.
+function fakeIndexer(cells: Array<Cell>): Indexer {
+  return ({
+    collector: (query: { type: Script }) => ({
+      collect: async function* () {
+        for (const cell of cells) {
+          if (cell.cell_output.type!.args === query.type.args) {
+            yield cell;
+          }
+        }
+      },
+    }),
+  } as unknown) as Indexer;
+}
+
+function tipHeader(number: bigint): Header {
+  const zero = "0x" + "00".repeat(32);
+  return {
+    compact_target: "0x0",
+    dao: zero,
+    epoch: "0x0",
+    hash: "0x" + "66".repeat(32),
+    nonce: "0x0",
+    number: "0x" + number.toString(16),
+    parent_hash: zero,
+    proposals_hash: zero,
+    timestamp: "0x0",
+    transactions_root: zero,
+    uncles_hash: zero,
+    version: "0x0",
+  };
+}
+
+// Lets aggregator 1 issue one subblock on top of lastData, at currentTime in
+// seconds, or in blocks when the setup uses block intervals. Both the PoA data
+// committed in outputs and the since of the PoA cell are returned, and written
+// to build/generator_tests/<name>.json.
+async function issueSubblock(
+  name: string,
+  setup: Omit<PoASetup, "identities" | "identity_size">,
+  lastData: PoAData,
+  currentTime: bigint
+): Promise<{ newData: PoAData; since: string }> {
+  const poaSetup: PoASetup = {
+    ...setup,
+    identity_size: 32,
+    identities: [0, 1].map((i) => utils.computeScriptHash(aggregatorLock(i))),
+  };
+  const poaCell: Cell = {
+    cell_output: {
+      capacity: "0x100000000",
+      lock: {
+        code_hash: "0x" + "22".repeat(32),
+        hash_type: "data",
+        args: SETUP_TYPE_ID_ARGS + DATA_TYPE_ID_ARGS.slice(2),
+      },
+    },
+    data: "0x",
+    out_point: { tx_hash: "0x" + "77".repeat(32), index: "0x0" },
+  };
+  const ownerCell: Cell = {
+    cell_output: { capacity: "0x100000000", lock: aggregatorLock(1) },
+    data: "0x",
+    out_point: { tx_hash: "0x" + "77".repeat(32), index: "0x1" },
+  };
+  const generator = new PoAGenerator(
+    generateAddress(aggregatorLock(1)),
+    fakeIndexer([
+      typeIdCell(SETUP_TYPE_ID_ARGS, serializePoASetup(poaSetup), 0),
+      typeIdCell(DATA_TYPE_ID_ARGS, serializePoAData(lastData), 1),
+    ]),
+    []
+  );
+  const medianTimeHex = "0x" + (currentTime * 1000n).toString(16);
+  const header = setup.round_interval_uses_seconds
+    ? undefined
+    : tipHeader(currentTime - 1n);
+
+  // A fresh generator only issues subblocks at handoffs, continuing a round
+  // relies on the round start kept from the handoff.
+  if (lastData.aggregator_index !== 1) {
+    assert.equal(
+      await generator.shouldIssueNewBlock(medianTimeHex, poaCell, header),
+      "Yes"
+    );
+  }
+  let txSkeleton = TransactionSkeleton({ cellProvider: null });
+  txSkeleton = txSkeleton.update("inputs", (inputs) =>
+    inputs.push(poaCell, ownerCell)
+  );
+  txSkeleton = await generator.fixTransactionSkeleton(
+    medianTimeHex,
+    txSkeleton,
+    header
+  );
+
+  // PoA cell, owner cell, then the PoA data cell
+  assert.equal(txSkeleton.get("inputs").count(), 3);
+  const newData = parsePoAData(
+    new Reader(txSkeleton.get("outputs").get(0)!.data).toArrayBuffer()
+  );
+  const since = txSkeleton.get("inputSinces").get(0)!;
+  const witness = txSkeleton.get("witnesses").get(0)!;
+  const fixture = {
+    setup: {
+      round_interval_uses_seconds: setup.round_interval_uses_seconds,
+      round_intervals: setup.round_intervals,
+      subblocks_per_round: setup.subblocks_per_round,
+      early_handoff: !!setup.early_handoff,
+      overlap_window: setup.overlap_window || 0,
+    },
+    last_data: poaDataJson(lastData),
+    current_data: poaDataJson(newData),
+    since,
+    witness,
+  };
+  mkdirSync(FIXTURE_DIR, { recursive: true });
+  writeFileSync(
+    join(FIXTURE_DIR, `${name}.json`),
+    JSON.stringify(fixture, null, 2)
+  );
+  return { newData, since };
+}
+
+function poaDataJson(poaData: PoAData) {
+  return {
+    round_initial_subtime: Number(poaData.round_initial_subtime),
+    subblock_subtime: Number(poaData.subblock_subtime),
+    subblock_index: poaData.subblock_index,
+    aggregator_index: poaData.aggregator_index,
+  };
+}
+
+const tests: Array<[string, () => Promise<void>]> = [];
+
+function test(name: string, run: () => Promise<void>) {
+  tests.push([name, run]);
+}
+
+test("overlap_handoff", async () => {
+  // Round of aggregator 0 ends at 1090, aggregator 1 takes over once the 20
+  // second overlap window starts, while aggregator 0 still has subblocks left.
+  const { newData, since } = await issueSubblock(
+    "overlap_handoff",
+    {
+      round_interval_uses_seconds: true,
+      aggregator_change_threshold: 2,
+      round_intervals: 90,
+      subblocks_per_round: 2,
+      overlap_window: 20,
+    },
+    {
+      round_initial_subtime: 1000n,
+      subblock_subtime: 1005n,
+      subblock_index: 0,
+      aggregator_index: 0,
+    },
+    1075n
+  );
+  assert.deepEqual(newData, {
+    round_initial_subtime: 1075n,
+    subblock_subtime: 1075n,
+    subblock_index: 0,
+    aggregator_index: 1,
+  });
+  assert.equal(since, "0x4000000000000433");
+});
+
+test("block_intervals_handoff", async () => {
+  // Round of aggregator 0 starts at block 1000 and lasts 90 blocks,
+  // aggregator 1 takes over in block 1090.
+  const { newData, since } = await issueSubblock(
+    "block_intervals_handoff",
+    {
+      round_interval_uses_seconds: false,
+      aggregator_change_threshold: 2,
+      round_intervals: 90,
+      subblocks_per_round: 2,
+    },
+    {
+      round_initial_subtime: 1000n,
+      subblock_subtime: 1005n,
+      subblock_index: 1,
+      aggregator_index: 0,
+    },
+    1090n
+  );
+  assert.deepEqual(newData, {
+    round_initial_subtime: 1090n,
+    subblock_subtime: 1090n,
+    subblock_index: 0,
+    aggregator_index: 1,
+  });
+  assert.equal(since, "0x442");
+});
+
+test("block_intervals_subblock", async () => {
+  // Aggregator 1 issues its second subblock in block 1010, subtime follows
+  // the block number instead of the last subtime.
+  const { newData, since } = await issueSubblock(
+    "block_intervals_subblock",
+    {
+      round_interval_uses_seconds: false,
+      aggregator_change_threshold: 2,
+      round_intervals: 90,
+      subblocks_per_round: 2,
+    },
+    {
+      round_initial_subtime: 1000n,
+      subblock_subtime: 1003n,
+      subblock_index: 0,
+      aggregator_index: 1,
+    },
+    1010n
+  );
+  assert.deepEqual(newData, {
+    round_initial_subtime: 1000n,
+    subblock_subtime: 1010n,
+    subblock_index: 1,
+    aggregator_index: 1,
+  });
+  assert.equal(since, "0x3f2");
+});
+
+async function main() {
+  let failed = 0;
+  for (const [name, run] of tests) {
+    try {
+      await run();
+      console.log(`test ${name} ... ok`);
+    } catch (e) {
+      failed++;
+      console.log(`test ${name} ... FAILED`);
+      console.log(e);
+    }
+  }
+  if (failed > 0) {
+    process.exit(1);
+  }
+}
+
+main();